@@ -23,6 +23,8 @@
 #include "table.h"
 #include "entry.h"
 #include "directory.h"
+#include "inverse.h"
+#include "long.h"
 
 int fatdirectorydebug = 0;
 #define dprintf if (fatdirectorydebug) printf
@@ -223,6 +225,7 @@ int fatfindfreeentry(fat *f, unit **directory, int *index) {
 		dprintf(" %d,%d", nextdirectory->n, *index);
 		if (! fatentryexists(nextdirectory, *index)) {
 			dprintf(" (found)\n");
+			*directory = nextdirectory;
 			return 0;
 		}
 	}
@@ -231,6 +234,7 @@ int fatfindfreeentry(fat *f, unit **directory, int *index) {
 
 	if (nextdirectory != NULL) {
 		dprintf(" found\n");
+		*directory = nextdirectory;
 		return 0;
 	}
 
@@ -247,7 +251,7 @@ int fatfindfreeentry(fat *f, unit **directory, int *index) {
 		/* fat32: search for a free cluster */
 
 	dprintf("searching for a free cluster\n");
-	new = fatclusterfindfree(f);
+	new = fatclusterallocate(f, (*directory)->n);
 	dprintf("free cluster found: %d\n", new);
 	if (new == FAT_ERR) {
 		*directory = NULL;
@@ -486,6 +490,8 @@ int fatcreatefiledir(fat *f, int32_t *dir, char *path,
 		return -1;
 	fatentrysetsize(*directory, *index, 0);
 	fatentrysetfirstcluster(*directory, *index, f->bits, FAT_UNUSED);
+	fatnameindexforget(f, -1);
+	fatpathcacheforget(f, 0);
 
 	free(buf);
 	return 0;
@@ -123,7 +123,7 @@ int fatentrysetshortname(unit *directory, int index, const char shortname[13]) {
 	res = fatstringtoshortname(& ENTRYPOS(directory, index, 0),
 			shortname);
 	if (! res)
-		directory->dirty = 1;
+		fatunitdirty(directory, index * 32, 11);
 	return res;
 }
 
@@ -155,7 +155,7 @@ int fatentryisdotfile(unit *directory, int index) {
 
 void fatentryfirst(unit *directory, int index, char first) {
 	ENTRYPOS(directory, index, 0) = first;
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32, 1);
 }
 
 void fatentrydelete(unit *directory, int index) {
@@ -164,7 +164,7 @@ void fatentrydelete(unit *directory, int index) {
 
 void fatentryzero(unit *directory, int index) {
 	memset(& ENTRYPOS(directory, index, 0), 0, 32);
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32, 32);
 }
 
 /*
@@ -260,7 +260,7 @@ int _fatentrysettime(unit *directory, int index, int time_pos, int date_pos,
 		_fattmtodate(tm, &d);
 		_unit16uint(directory, 32 * index + date_pos) = htole16(d);
 	}
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32, 32);
 	return 0;
 }
 
@@ -336,7 +336,7 @@ int fatentrysetfirstcluster(unit *directory, int index, int bits, int32_t n) {
 		_unit16int(directory, pos) = htole16((n >> 16) & 0xFFFF);
 	}
 
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32, 32);
 
 	return 0;
 }
@@ -350,7 +350,7 @@ unsigned char fatentrygetattributes(unit *directory, int index) {
 
 void fatentrysetattributes(unit *directory, int index, unsigned char attr) {
 	_unit8int(directory, index * 32 + 11) = attr;
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32 + 11, 1);
 }
 
 int fatentryisdirectory(unit *directory, int index) {
@@ -366,7 +366,7 @@ uint32_t fatentrygetsize(unit *directory, int index) {
 
 void fatentrysetsize(unit *directory, int index, uint32_t size) {
 	_unit32uint(directory, index * 32 + 0x1C) = htole32(size);
-	directory->dirty = 1;
+	fatunitdirty(directory, index * 32 + 0x1C, 4);
 }
 
 /*
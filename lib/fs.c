@@ -17,6 +17,7 @@
  */
 
 #define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
@@ -28,6 +29,8 @@
 #include "fs.h"
 #include "boot.h"
 #include "table.h"
+#include "inverse.h"
+#include "long.h"
 
 int fatdebug = 0;
 #define dprintf if (fatdebug) printf
@@ -45,6 +48,12 @@ int fatdebug = 0;
  */
 #define BOOTSECTORSIZE 512
 
+/*
+ * default number of bytes read at once when reading a cluster that is followed
+ * by contiguous clusters in its chain, see fatclusterread()
+ */
+#define FAT_READAHEAD (64 * 1024)
+
 /*
  * initialize a fat structure; nothing is read from a device
  */
@@ -56,6 +65,7 @@ fat *fatcreate() {
 	f->fd = -1;
 	f->devicename = NULL;
 	f->bits = 0;
+	f->width = NULL;
 	f->nfat = FAT_ALL;
 	f->insensitive = 0;
 
@@ -63,9 +73,52 @@ fat *fatcreate() {
 	f->info = NULL;
 	f->sectors = NULL;
 	f->clusters = NULL;
+	f->pool = NULL;
+	f->io = &fatunitpio;
+	f->readahead = FAT_READAHEAD;
+	f->slab = fatunitslabcreate();
+	fatunitsetslab(&f->sectors, f->slab);
+	fatunitsetslab(&f->clusters, f->slab);
+
+	f->decoded = NULL;
+	f->decodedfat = FAT_ALL;
+	f->decodedsize = 0;
+
+	f->runs = NULL;
+	f->nruns = 0;
+	f->maxruns = 0;
+	f->runsgap = 0;
+	f->runsfat = FAT_ALL;
+	f->runssize = 0;
+
+	f->freemap = NULL;
+	f->freemapknown = NULL;
+	f->freemapfat = FAT_ALL;
+	f->freemapsize = 0;
+	f->extents = NULL;
+	f->extentsleaves = 0;
+
+	f->mirror = 0;
+	f->mirrorrange = NULL;
+	f->mirrorsize = 0;
+
+	f->chainmaps = NULL;
+	f->chainused = 0;
+	f->changes = 0;
+
+	f->nameindex = NULL;
+	f->nameindexused = 0;
+	f->pathcache = NULL;
 
 	f->last = 2;
 	f->free = -1;
+
+	f->policy = FAT_ALLOC_NEXT;
+	f->allocsize = 1;
+	f->allocbegin = -1;
+	f->allocend = -1;
+	f->allocnear = -1;
+
 	f->user = NULL;
 
 	return f;
@@ -96,14 +149,17 @@ fat *fatopenonly(char *filename, off_t offset, int boot) {
 	f = fatcreate();
 	f->devicename = filename;
 
-	f->fd = open(filename, O_RDWR | O_DIRECT);
+	f->fd = open(filename, O_RDWR);
 	if (f->fd == -1 && errno == EACCES) {
-		f->fd = open(filename, O_RDONLY | O_DIRECT);
+		f->fd = open(filename, O_RDONLY);
 		if (f->fd != -1)
 			printf("WARNING: %s opened read-only\n", filename);
 	}
 	if (f->fd == -1) {
 		perror(filename);
+		fatunitdeallocate(f->sectors);
+		fatunitdeallocate(f->clusters);
+		fatunitslabdestroy(f->slab);
 		free(f);
 		return NULL;
 	}
@@ -208,10 +264,19 @@ int fatcheck(fat *f) {
  * flush to the filesystem
  */
 int fatflush(fat *f) {
+	int res;
+
+	res = fatmirrorfats(f);
+	if (res)
+		printf("cannot copy the first fat to the others\n");
 	/* boot and info sectors are also in the cache */
 	fatunitflush(f->sectors);
 	fatunitflush(f->clusters);
-	return 0;
+	if (f->io->flush(f->io, f->fd)) {
+		perror("flushing");
+		return -1;
+	}
+	return res;
 }
 
 /*
@@ -222,6 +287,18 @@ int fatquit(fat *f) {
 	fatunitdeallocate(f->sectors);
 	dprintf("deallocating clusters\n");
 	fatunitdeallocate(f->clusters);
+	if (f->pool != NULL)
+		fatunitpooldestroy(f->pool);
+	fatunitslabdestroy(f->slab);
+	free(f->decoded);
+	free(f->runs);
+	free(f->freemap);
+	free(f->freemapknown);
+	free(f->extents);
+	free(f->mirrorrange);
+	fatchainfree(f);
+	fatsetnameindex(f, 0);
+	fatsetpathcache(f, 0);
 
 	if (-1 == close(f->fd)) {
 		perror("closing");
@@ -231,6 +308,65 @@ int fatquit(fat *f) {
 	return 0;
 }
 
+/*
+ * limit the memory used by the caches; sectors and clusters share the limit
+ */
+int fatsetcachelimit(fat *f, uint64_t max, int policy) {
+	if (policy != UNIT_LRU && policy != UNIT_SLRU)
+		return -1;
+
+	if (f->pool == NULL) {
+		f->pool = fatunitpoolcreate(max, policy);
+		fatunitsetpool(&f->sectors, f->pool);
+		fatunitsetpool(&f->clusters, f->pool);
+		return 0;
+	}
+
+	f->pool->max = max;
+	f->pool->policy = policy;
+	fatunitsetpool(&f->sectors, f->pool);
+	fatunitsetpool(&f->clusters, f->pool);
+	return 0;
+}
+
+/*
+ * change the i/o backend; the units already read switch to it as well
+ */
+void fatsetio(fat *f, unitio *io) {
+	f->io = io;
+	fatunitsetio(&f->sectors, io);
+	fatunitsetio(&f->clusters, io);
+}
+
+/*
+ * direct i/o: bypass the buffers of the operating system
+ */
+int fatsetdirect(fat *f) {
+	int flags;
+
+	if (O_DIRECT == 0) {
+		printf("direct i/o not supported\n");
+		return -1;
+	}
+
+	flags = fcntl(f->fd, F_GETFL);
+	if (flags == -1 || fcntl(f->fd, F_SETFL, flags | O_DIRECT) == -1) {
+		perror("direct i/o");
+		return -1;
+	}
+
+	fatsetio(f, &fatunitdirectio);
+	return 0;
+}
+
+/*
+ * statistics of the caches
+ */
+void fatstats(fat *f, unitstats *sectors, unitstats *clusters, int reset) {
+	fatunitstats(f->sectors, sectors, reset);
+	fatunitstats(f->clusters, clusters, reset);
+}
+
 /*
  * close the file
  */
@@ -41,17 +41,55 @@ typedef struct {
 	uint64_t offset;
 
 	int bits;				/* 12, 16 or 32 */
+	const struct fatwidth *width;		/* entry access for the bits */
 	int nfat;				/* file alloc. table to use */
 	int insensitive;			/* case-insensitive lookup? */
 
 	unit *boot;				/* boot sector */
 	unit *info; 				/* fs info sector (fat32) */
-	unit *sectors;				/* cache for sectors */
-	unit *clusters;				/* cache for clusters */
+	unitcache *sectors;			/* cache for sectors */
+	unitcache *clusters;			/* cache for clusters */
+	unitpool *pool;				/* memory limit of caches */
+	unitio *io;				/* i/o backend */
+	int readahead;				/* bytes read along chains */
+	unitslab *slab;				/* allocator of units */
+
+	uint32_t *decoded;			/* entries of a fat, if any */
+	int decodedfat;				/* fat they are from */
+	int32_t decodedsize;			/* number of entries */
+
+	struct fatrun *runs;			/* a fat as runs of entries */
+	int32_t nruns, maxruns, runsgap;
+	int runsfat;				/* fat they are from */
+	int32_t runssize;			/* number of entries */
+
+	uint64_t *freemap;			/* bitmap of free clusters */
+	unsigned char *freemapknown;		/* blocks of it filled */
+	int freemapfat;				/* fat it is from */
+	int32_t freemapsize;			/* number of bits */
+	struct fatextent *extents;		/* index of free extents */
+	int32_t extentsleaves;
+
+	int mirror;				/* other fats copied at flush */
+	int *mirrorrange;			/* bytes to copy, per sector */
+	int32_t mirrorsize;			/* sectors of a fat */
+
+	struct fatchainmap *chainmaps;		/* positions in chains */
+	uint64_t chainused;
+	uint32_t changes;			/* count of changed entries */
+
+	struct fatnameindex *nameindex;		/* names in directories */
+	uint64_t nameindexused;
+	struct fatpathcache *pathcache;		/* paths looked up */
 
 	int32_t last;				/* last found free cluster */
 	int32_t free;				/* number of free clusters */
 
+	int policy;				/* see fatsetallocation() */
+	int32_t allocsize;			/* sequence to look for */
+	int32_t allocbegin, allocend;		/* area to allocate from */
+	int32_t allocnear;			/* cluster of the directory */
+
 	void *user;				/* free for program use */
 } fat;
 
@@ -69,6 +107,30 @@ int fatflush(fat *f);
 int fatquit(fat *f);
 int fatclose(fat *f);
 
+/*
+ * limit the memory used by the data in the caches (0 = no limit); policy is
+ * UNIT_LRU or UNIT_SLRU, see unit.h
+ */
+int fatsetcachelimit(fat *f, uint64_t max, int policy);
+
+/*
+ * read and write the filesystem by an i/o backend other than the default
+ * fatunitpio, see unit.h
+ */
+void fatsetio(fat *f, unitio *io);
+
+/*
+ * access the device with direct i/o, bypassing the buffers of the operating
+ * system; the caches of the library become the only ones
+ */
+int fatsetdirect(fat *f);
+
+/*
+ * copy the statistics of the sector and the cluster caches, see unit.h; either
+ * pointer may be NULL; reset the statistics if reset is not zero
+ */
+void fatstats(fat *f, unitstats *sectors, unitstats *clusters, int reset);
+
 /*
  * global parameters of a fat
  */
@@ -49,6 +49,7 @@ int fatlongdebug = 0;
 	(fatunitgetdata((directory))[(index) * 32 + (pos)])
 
 #define MIN(x,y) (((x) < (y)) ? (x) : (y))
+#define MAX(x,y) (((x) > (y)) ? (x) : (y))
 
 #define UTF8_CHAR_SIZE 3
 
@@ -309,10 +310,798 @@ int fatnextname(fat *f, unit **directory, int *index, char **name) {
 }
 
 /*
- * string matching, case sensitive or not depending on f->insensitive
+ * the key names are compared by: the name itself, or its case folding if
+ * insensitive; the folding goes in *key, which is enlarged as needed and freed
+ * by the caller, so that a name is folded only once
  */
-int _fatwcscmp(fat *f, const char *a, const char *b) {
-	return f->insensitive ? utf8casecmp(a, b) : utf8cmp(a, b);
+char *_fatnamekey(int insensitive, const char *name, char **key, size_t *size) {
+	size_t len;
+
+	if (! insensitive)
+		return (char *) name;
+
+	len = utf8casefold(*key, *size, name);
+	if (len >= *size) {
+		*size = MAX(len + 1, 2 * *size);
+		*key = realloc(*key, *size);
+		if (*key == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		utf8casefold(*key, *size, name);
+	}
+	return *key;
+}
+
+/*
+ * index of the names in a directory: a hash table from each name to the
+ * position of its short entry and of the start of its long name; it is built
+ * on the first lookup in the directory and kept up to date by the functions
+ * that create and delete files; a name found is checked against the entries,
+ * and the index is rebuilt if they changed
+ */
+
+/* directories indexed at time */
+#define NAMEINDEX_DIRS 16
+
+/* deleted files to check */
+#define NAMEINDEX_DELETED 16
+
+struct fatnameentry {
+	uint32_t hash;
+	int32_t cluster;		/* short entry */
+	int index;
+	int32_t longcluster;		/* start of the long name */
+	int longindex;
+	unsigned char shortname[12];	/* short name and case byte */
+	int name;			/* offset in names */
+	int next;			/* next in the bucket, -1 = none */
+};
+
+struct fatdeleted {
+	int32_t cluster;		/* short entry */
+	int index;
+	unsigned char shortname[11];
+	int inshorts;			/* in the table of the short names */
+};
+
+struct fatnameindex {
+	int32_t dir;			/* first cluster, 0 = unused slot */
+	int insensitive;		/* names are case folded */
+	uint64_t used;			/* time of last use */
+	struct fatnameentry *entries;
+	int nentries, maxentries, removed;
+	int *buckets;
+	int nbuckets;
+	char *names;			/* the keys, zero-terminated */
+	int namessize, maxnames;
+	int freeknown;			/* free slots mapped */
+	int32_t *clusters;		/* the chain of the directory */
+	int nclusters, maxclusters;
+	int perunit;			/* slots in a cluster */
+	struct fatfreerun *free;	/* runs of free slots */
+	int nfree, maxfree;
+	int shortknown;			/* short names in the table */
+	struct fatshortname *shorts;
+	int nshorts, liveshorts, maxshorts;
+	uint64_t *bloom;
+	struct fatdeleted deleted[NAMEINDEX_DELETED];
+	int ndeleted;
+};
+
+void *_fatnameindexrealloc(void *p, size_t size) {
+	p = realloc(p, size);
+	if (p == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+void _fatnameindexfree(struct fatnameindex *x) {
+	free(x->entries);
+	free(x->buckets);
+	free(x->names);
+	free(x->clusters);
+	free(x->free);
+	free(x->shorts);
+	free(x->bloom);
+	memset(x, 0, sizeof(struct fatnameindex));
+}
+
+void fatsetnameindex(fat *f, int on) {
+	int i;
+
+	if (on && f->nameindex == NULL) {
+		f->nameindex = calloc(NAMEINDEX_DIRS,
+			sizeof(struct fatnameindex));
+		if (f->nameindex == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+
+	if (! on && f->nameindex != NULL) {
+		for (i = 0; i < NAMEINDEX_DIRS; i++)
+			_fatnameindexfree(f->nameindex + i);
+		free(f->nameindex);
+		f->nameindex = NULL;
+	}
+}
+
+void fatnameindexforget(fat *f, int32_t dir) {
+	int i;
+
+	if (f->nameindex == NULL)
+		return;
+
+	for (i = 0; i < NAMEINDEX_DIRS; i++)
+		if (f->nameindex[i].dir != 0 &&
+		    (dir == -1 || f->nameindex[i].dir == dir))
+			_fatnameindexfree(f->nameindex + i);
+}
+
+void _fatnameindexrehash(struct fatnameindex *x, int nbuckets) {
+	struct fatnameentry *e;
+	int i, b;
+
+	x->nbuckets = nbuckets;
+	x->buckets = _fatnameindexrealloc(x->buckets,
+		x->nbuckets * sizeof(int));
+	for (b = 0; b < x->nbuckets; b++)
+		x->buckets[b] = -1;
+
+	for (i = 0; i < x->nentries; i++) {
+		e = x->entries + i;
+		if (e->name == -1)
+			continue;
+		b = e->hash & (x->nbuckets - 1);
+		e->next = x->buckets[b];
+		x->buckets[b] = i;
+	}
+}
+
+struct fatnameentry *_fatnameindexfind(struct fatnameindex *x,
+		const char *key, uint32_t hash) {
+	struct fatnameentry *e;
+	int i;
+
+	for (i = x->buckets[hash & (x->nbuckets - 1)]; i != -1; i = e->next) {
+		e = x->entries + i;
+		if (e->hash == hash && ! strcmp(key, x->names + e->name))
+			return e;
+	}
+	return NULL;
+}
+
+void _fatnameentryset(struct fatnameentry *e, unit *directory, int index,
+		unit *longdirectory, int longindex) {
+	e->cluster = directory->n;
+	e->index = index;
+	e->longcluster = longdirectory->n;
+	e->longindex = longindex;
+	memcpy(e->shortname, & ENTRYPOS(directory, index, 0), 11);
+	e->shortname[11] = ENTRYPOS(directory, index, 12);
+}
+
+void _fatnameindexadd(struct fatnameindex *x, const char *key,
+		uint32_t hash, unit *directory, int index,
+		unit *longdirectory, int longindex) {
+	struct fatnameentry *e;
+	int len, b;
+
+	if (x->nentries == x->maxentries) {
+		x->maxentries = x->maxentries == 0 ? 64 : x->maxentries * 2;
+		x->entries = _fatnameindexrealloc(x->entries,
+			x->maxentries * sizeof(struct fatnameentry));
+	}
+	len = strlen(key) + 1;
+	if (x->namessize + len > x->maxnames) {
+		while (x->namessize + len > x->maxnames)
+			x->maxnames = x->maxnames == 0 ? 1024 : x->maxnames * 2;
+		x->names = _fatnameindexrealloc(x->names, x->maxnames);
+	}
+	if (x->nentries >= x->nbuckets)
+		_fatnameindexrehash(x, x->nbuckets * 2);
+
+	e = x->entries + x->nentries;
+	e->hash = hash;
+	_fatnameentryset(e, directory, index, longdirectory, longindex);
+	memcpy(x->names + x->namessize, key, len);
+	e->name = x->namessize;
+	x->namessize += len;
+
+	b = hash & (x->nbuckets - 1);
+	e->next = x->buckets[b];
+	x->buckets[b] = x->nentries++;
+}
+
+void _fatnameindexunlink(struct fatnameindex *x, struct fatnameentry *e) {
+	int *i;
+
+	for (i = x->buckets + (e->hash & (x->nbuckets - 1));
+	     *i != -1;
+	     i = & x->entries[*i].next)
+		if (x->entries + *i == e) {
+			*i = e->next;
+			e->name = -1;
+			break;
+		}
+
+	/* many removed entries: rebuild on next lookup */
+	if (++x->removed > 64 && x->removed > x->nentries / 2)
+		_fatnameindexfree(x);
+}
+
+/*
+ * the index of a directory, possibly building it
+ */
+struct fatnameindex *_fatnameindexget(fat *f, int32_t dir, int build) {
+	struct fatnameindex *x;
+	unit *directory, *longdirectory;
+	int index, longindex;
+	char *name, *key, *fold;
+	size_t size;
+	uint32_t hash;
+	int i;
+
+	if (dir <= 0)
+		return NULL;
+
+	x = NULL;
+	for (i = 0; i < NAMEINDEX_DIRS; i++) {
+		if (f->nameindex[i].dir == dir) {
+			x = f->nameindex + i;
+			break;
+		}
+		if (x == NULL || f->nameindex[i].used < x->used)
+			x = f->nameindex + i;
+	}
+
+	if (x->dir == dir && x->insensitive != f->insensitive)
+		_fatnameindexfree(x);
+	else if (x->dir == dir) {
+		x->used = ++f->nameindexused;
+		return x;
+	}
+	if (! build)
+		return NULL;
+
+	directory = fatclusterread(f, dir);
+	if (directory == NULL)
+		return NULL;
+
+	dprintf("indexing directory %d\n", dir);
+	_fatnameindexfree(x);
+	x->dir = dir;
+	x->insensitive = f->insensitive;
+	x->used = ++f->nameindexused;
+	_fatnameindexrehash(x, 64);
+
+	fold = NULL;
+	size = 0;
+	for (index = 0;
+	     fatlongnext(f, &directory, &index,
+	     		&longdirectory, &longindex, &name) != FAT_END;
+	     fatnextentry(f, &directory, &index)) {
+		key = _fatnamekey(x->insensitive, name, &fold, &size);
+		hash = utf8hash(key);
+		if (_fatnameindexfind(x, key, hash) == NULL)
+			_fatnameindexadd(x, key, hash,
+				directory, index, longdirectory, longindex);
+		free(name);
+	}
+	free(fold);
+
+	return x;
+}
+
+/*
+ * check a name in the index against the directory entries
+ */
+int _fatnameindexcheck(fat *f, struct fatnameentry *e,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex) {
+	*directory = fatclusterread(f, e->cluster);
+	*longdirectory = e->longcluster == e->cluster ?
+		*directory : fatclusterread(f, e->longcluster);
+	if (*directory == NULL || *longdirectory == NULL)
+		return -1;
+	*index = e->index;
+	*longindex = e->longindex;
+
+	if (! fatentryexists(*directory, *index) ||
+	    fatentryislongpart(*directory, *index) ||
+	    memcmp(e->shortname, & ENTRYPOS(*directory, *index, 0), 11) ||
+	    e->shortname[11] != ENTRYPOS(*directory, *index, 12))
+		return -1;
+
+	if (*longdirectory == *directory && *longindex == *index)
+		return 0;
+
+	if (! fatentryexists(*longdirectory, *longindex) ||
+	    ! fatentryislongpart(*longdirectory, *longindex) ||
+	    ! (ENTRYPOS(*longdirectory, *longindex, 0) & 0x40) ||
+	    ENTRYPOS(*longdirectory, *longindex, 13) !=
+	    		fatentrychecksum(*directory, *index))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * look up a name in the index: 0 if found, -1 if not, 1 if the index cannot
+ * be used
+ */
+int _fatnameindexlookup(fat *f, int32_t dir, char *name,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex) {
+	struct fatnameindex *x;
+	struct fatnameentry *e;
+	char *key, *fold;
+	size_t size;
+	uint32_t hash;
+	int attempt, res;
+
+	fold = NULL;
+	size = 0;
+	key = _fatnamekey(f->insensitive, name, &fold, &size);
+	hash = utf8hash(key);
+
+	res = 1;
+	for (attempt = 0; attempt < 2 && res == 1; attempt++) {
+		x = _fatnameindexget(f, dir, 1);
+		if (x == NULL)
+			break;
+		e = _fatnameindexfind(x, key, hash);
+		if (e == NULL) {
+			*directory = NULL;
+			res = -1;
+		}
+		else if (! _fatnameindexcheck(f, e,
+				directory, index, longdirectory, longindex))
+			res = 0;
+		else {
+			dprintf("index of directory %d out of date\n", dir);
+			_fatnameindexfree(x);
+		}
+	}
+
+	free(fold);
+	return res;
+}
+
+/*
+ * free slots of an indexed directory: the runs of deleted or unused entries,
+ * by their position from the start of the directory; built on the first
+ * search for free entries, then updated when entries are taken and when files
+ * are deleted
+ */
+
+struct fatfreerun {
+	int start;
+	int length;
+};
+
+void _fatfreeslotsadd(struct fatnameindex *x, int start, int length) {
+	struct fatfreerun *r;
+	int i, end;
+
+	if (length <= 0)
+		return;
+
+	for (i = 0; i < x->nfree && x->free[i].start < start; i++) {
+	}
+
+	if (i > 0 && x->free[i - 1].start + x->free[i - 1].length >= start) {
+		r = x->free + i - 1;
+		end = MAX(r->start + r->length, start + length);
+		r->length = end - r->start;
+	}
+	else {
+		if (x->nfree == x->maxfree) {
+			x->maxfree = x->maxfree == 0 ? 16 : x->maxfree * 2;
+			x->free = _fatnameindexrealloc(x->free,
+				x->maxfree * sizeof(struct fatfreerun));
+		}
+		memmove(x->free + i + 1, x->free + i,
+			(x->nfree - i) * sizeof(struct fatfreerun));
+		x->nfree++;
+		r = x->free + i;
+		r->start = start;
+		r->length = length;
+	}
+
+	/* merge with the following runs */
+	i = r - x->free + 1;
+	while (i < x->nfree && x->free[i].start <= r->start + r->length) {
+		end = MAX(r->start + r->length,
+			x->free[i].start + x->free[i].length);
+		r->length = end - r->start;
+		memmove(x->free + i, x->free + i + 1,
+			(x->nfree - i - 1) * sizeof(struct fatfreerun));
+		x->nfree--;
+	}
+}
+
+void _fatfreeslotsuse(struct fatnameindex *x, int start, int length) {
+	struct fatfreerun *r;
+	int i, end, rend;
+
+	end = start + length;
+	for (i = 0; i < x->nfree; i++) {
+		r = x->free + i;
+		rend = r->start + r->length;
+		if (rend <= start || r->start >= end)
+			continue;
+		if (r->start < start && rend > end) {
+			r->length = start - r->start;
+			_fatfreeslotsadd(x, end, rend - end);
+			break;
+		}
+		if (r->start < start)
+			r->length = start - r->start;
+		else if (rend > end) {
+			r->start = end;
+			r->length = rend - end;
+		}
+		else {
+			memmove(x->free + i, x->free + i + 1,
+				(x->nfree - i - 1) * sizeof(struct fatfreerun));
+			x->nfree--;
+			i--;
+		}
+	}
+}
+
+void _fatfreeslotscluster(struct fatnameindex *x, int32_t cluster) {
+	if (x->nclusters == x->maxclusters) {
+		x->maxclusters = x->maxclusters == 0 ? 16 : x->maxclusters * 2;
+		x->clusters = _fatnameindexrealloc(x->clusters,
+			x->maxclusters * sizeof(int32_t));
+	}
+	x->clusters[x->nclusters++] = cluster;
+}
+
+/*
+ * position of an entry in the directory, -1 if not in it
+ */
+int _fatfreeslotsposition(struct fatnameindex *x, int32_t cluster, int index) {
+	int i;
+
+	for (i = 0; i < x->nclusters; i++)
+		if (x->clusters[i] == cluster)
+			return i * x->perunit + index;
+	return -1;
+}
+
+void _fatfreeslotsbuild(fat *f, struct fatnameindex *x) {
+	unit *directory;
+	int index, slot, res;
+	struct fatfreerun *r;
+
+	x->nfree = 0;
+	x->nclusters = 0;
+
+	directory = fatclusterread(f, x->dir);
+	if (directory == NULL)
+		return;
+	x->perunit = directory->size / 32;
+
+	dprintf("free slots of directory %d\n", x->dir);
+	for (index = 0, slot = 0, res = 0;
+	     res >= 0;
+	     res = fatnextentry(f, &directory, &index), slot++) {
+		if (index == 0)
+			_fatfreeslotscluster(x, directory->n);
+		if (fatentryexists(directory, index))
+			continue;
+		r = x->nfree > 0 ? x->free + x->nfree - 1 : NULL;
+		if (r != NULL && r->start + r->length == slot)
+			r->length++;
+		else
+			_fatfreeslotsadd(x, slot, 1);
+	}
+
+	x->freeknown = res != -3;
+}
+
+/*
+ * clusters added to the directory are free
+ */
+void _fatfreeslotsgrow(fat *f, struct fatnameindex *x) {
+	int32_t next;
+
+	while ((next = fatgetnextcluster(f, x->clusters[x->nclusters - 1]))
+			>= FAT_FIRST && x->nclusters <= fatlastcluster(f)) {
+		_fatfreeslotsadd(x, x->nclusters * x->perunit, x->perunit);
+		_fatfreeslotscluster(x, next);
+	}
+}
+
+/*
+ * short names of an indexed directory: a hash table of the names of its
+ * entries, with a bloom filter in front since most names looked up when
+ * generating a new one are not there; built on the first search, then updated
+ * when files are created and deleted
+ */
+
+struct fatshortname {
+	unsigned char name[11];
+	unsigned char state;		/* 0 = empty, 1 = used, 2 = removed */
+};
+
+uint32_t _fatshortnameshash(const unsigned char name[11]) {
+	uint32_t hash;
+	int i;
+
+	hash = 2166136261u;
+	for (i = 0; i < 11; i++)
+		hash = (hash ^ name[i]) * 16777619u;
+	return hash;
+}
+
+/* the two bits of the bloom filter */
+#define BLOOMBIT1(x, hash) ((hash) & ((x)->maxshorts * 8 - 1))
+#define BLOOMBIT2(x, hash) (((hash) >> 13 ^ (hash) << 7) & \
+	((x)->maxshorts * 8 - 1))
+
+struct fatshortname *_fatshortnamesfind(struct fatnameindex *x,
+		const unsigned char name[11], uint32_t hash) {
+	struct fatshortname *s;
+	uint32_t b1, b2;
+	int i;
+
+	if (x->maxshorts == 0)
+		return NULL;
+
+	b1 = BLOOMBIT1(x, hash);
+	b2 = BLOOMBIT2(x, hash);
+	if (! (x->bloom[b1 / 64] & (1ULL << (b1 % 64))) ||
+	    ! (x->bloom[b2 / 64] & (1ULL << (b2 % 64))))
+		return NULL;
+
+	for (i = hash & (x->maxshorts - 1);
+	     x->shorts[i].state != 0;
+	     i = (i + 1) & (x->maxshorts - 1)) {
+		s = x->shorts + i;
+		if (s->state == 1 && ! memcmp(s->name, name, 11))
+			return s;
+	}
+	return NULL;
+}
+
+void _fatshortnamesinsert(struct fatnameindex *x,
+		const unsigned char name[11], uint32_t hash) {
+	struct fatshortname *s;
+	uint32_t b1, b2;
+	int i;
+
+	for (i = hash & (x->maxshorts - 1);
+	     x->shorts[i].state == 1;
+	     i = (i + 1) & (x->maxshorts - 1)) {
+	}
+	s = x->shorts + i;
+	if (s->state == 0)
+		x->nshorts++;
+	x->liveshorts++;
+	memcpy(s->name, name, 11);
+	s->state = 1;
+
+	b1 = BLOOMBIT1(x, hash);
+	b2 = BLOOMBIT2(x, hash);
+	x->bloom[b1 / 64] |= 1ULL << (b1 % 64);
+	x->bloom[b2 / 64] |= 1ULL << (b2 % 64);
+}
+
+void _fatshortnamesrehash(struct fatnameindex *x, int maxshorts) {
+	struct fatshortname *old;
+	int i, maxold;
+
+	old = x->shorts;
+	maxold = x->maxshorts;
+
+	x->maxshorts = maxshorts;
+	x->nshorts = 0;
+	x->liveshorts = 0;
+	x->shorts = calloc(maxshorts, sizeof(struct fatshortname));
+	x->bloom = _fatnameindexrealloc(x->bloom, maxshorts / 8 * 8);
+	if (x->shorts == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	memset(x->bloom, 0, maxshorts / 8 * 8);
+
+	for (i = 0; i < maxold; i++)
+		if (old[i].state == 1)
+			_fatshortnamesinsert(x, old[i].name,
+				_fatshortnameshash(old[i].name));
+	free(old);
+}
+
+void _fatshortnamesadd(struct fatnameindex *x, const unsigned char name[11]) {
+	uint32_t hash;
+
+	hash = _fatshortnameshash(name);
+	if (_fatshortnamesfind(x, name, hash) != NULL)
+		return;
+	if (2 * (x->nshorts + 1) > x->maxshorts)
+		_fatshortnamesrehash(x, x->maxshorts == 0 ? 64 :
+			x->liveshorts + 1 > x->maxshorts / 4 ?
+				x->maxshorts * 2 : x->maxshorts);
+	_fatshortnamesinsert(x, name, hash);
+}
+
+void _fatshortnamesremove(struct fatnameindex *x,
+		const unsigned char name[11]) {
+	struct fatshortname *s;
+
+	s = _fatshortnamesfind(x, name, _fatshortnameshash(name));
+	if (s != NULL) {
+		s->state = 2;
+		x->liveshorts--;
+	}
+}
+
+void _fatshortnamesbuild(fat *f, struct fatnameindex *x) {
+	unit *directory;
+	int index, i;
+
+	directory = fatclusterread(f, x->dir);
+	if (directory == NULL)
+		return;
+
+	dprintf("short names of directory %d\n", x->dir);
+	for (index = -1; ! fatnextentry(f, &directory, &index); )
+		if (fatentryexists(directory, index) &&
+		    ! fatentryislongpart(directory, index))
+			_fatshortnamesadd(x, & ENTRYPOS(directory, index, 0));
+
+	/* files deleted before are not in the table */
+	for (i = 0; i < x->ndeleted; i++)
+		x->deleted[i].inshorts = 0;
+	x->shortknown = 1;
+}
+
+/*
+ * files deleted: their long name is freed now, their short entry by the
+ * caller of fatdeletelong() after it; the short entries are checked at the
+ * next search for free entries or for a short name
+ */
+void _fatnameindexdeleted(fat *f, struct fatnameindex *x) {
+	struct fatdeleted *d;
+	unit *directory;
+	int i, slot;
+
+	for (i = 0; i < x->ndeleted; i++) {
+		d = x->deleted + i;
+		directory = fatclusterread(f, d->cluster);
+		if (directory == NULL)
+			continue;
+		if (fatentryexists(directory, d->index) &&
+		    ! memcmp(& ENTRYPOS(directory, d->index, 0),
+		    		d->shortname, 11))
+			continue;
+		slot = _fatfreeslotsposition(x, d->cluster, d->index);
+		if (x->freeknown && slot != -1 &&
+		    ! fatentryexists(directory, d->index))
+			_fatfreeslotsadd(x, slot, 1);
+		if (x->shortknown && d->inshorts)
+			_fatshortnamesremove(x, d->shortname);
+	}
+	x->ndeleted = 0;
+}
+
+void _fatnameindexdelete(fat *f, struct fatnameindex *x,
+		struct fatnameentry *e) {
+	struct fatdeleted *d;
+	int start, end;
+
+	if (x->freeknown) {
+		start = _fatfreeslotsposition(x, e->longcluster, e->longindex);
+		end = _fatfreeslotsposition(x, e->cluster, e->index);
+		if (start == -1 || end < start)
+			x->freeknown = 0;
+		else
+			_fatfreeslotsadd(x, start, end - start);
+	}
+
+	if (x->ndeleted == NAMEINDEX_DELETED)
+		_fatnameindexdeleted(f, x);
+	d = x->deleted + x->ndeleted++;
+	d->cluster = e->cluster;
+	d->index = e->index;
+	memcpy(d->shortname, e->shortname, 11);
+	d->inshorts = x->shortknown;
+}
+
+/*
+ * first position of len free slots, possibly running past the end of the
+ * directory
+ */
+int _fatfreeslotsfind(fat *f, struct fatnameindex *x, int len) {
+	struct fatfreerun *r;
+	int i, slots;
+
+	_fatnameindexdeleted(f, x);
+
+	slots = x->nclusters * x->perunit;
+	for (i = 0; i < x->nfree; i++) {
+		r = x->free + i;
+		if (r->length >= len || r->start + r->length == slots)
+			return r->start;
+	}
+	return slots;
+}
+
+/*
+ * add or remove a file from the indexes
+ */
+void _fatnameindexinsert(fat *f, int32_t dir,
+		unit *longdirectory, int longindex) {
+	struct fatnameindex *x;
+	unit *directory;
+	int index, res;
+	char *name, *key, *fold;
+	size_t size;
+	uint32_t hash;
+
+	if (f->nameindex == NULL)
+		return;
+	x = _fatnameindexget(f, dir, 0);
+	if (x == NULL)
+		return;
+
+	fold = NULL;
+	size = 0;
+	res = fatlongentrytoshort(f, longdirectory, longindex,
+		&directory, &index, &name);
+	if (res & FAT_SHORT) {
+		key = _fatnamekey(x->insensitive, name, &fold, &size);
+		hash = utf8hash(key);
+		if (_fatnameindexfind(x, key, hash) != NULL)
+			_fatnameindexfree(x);
+		else {
+			_fatnameindexadd(x, key, hash,
+				directory, index, longdirectory, longindex);
+			if (x->shortknown)
+				_fatshortnamesadd(x,
+					& ENTRYPOS(directory, index, 0));
+		}
+	}
+	free(name);
+	free(fold);
+}
+
+void _fatnameindexremove(fat *f, unit *longdirectory, int longindex) {
+	struct fatnameindex *x;
+	struct fatnameentry *e;
+	unit *directory;
+	int index, res, i;
+	char *name, *key, *fold;
+	size_t size;
+
+	if (f->nameindex == NULL)
+		return;
+
+	fold = NULL;
+	size = 0;
+	res = fatlongentrytoshort(f, longdirectory, longindex,
+		&directory, &index, &name);
+	for (i = 0; i < NAMEINDEX_DIRS && (res & FAT_SHORT); i++) {
+		x = f->nameindex + i;
+		if (x->dir == 0)
+			continue;
+		key = _fatnamekey(x->insensitive, name, &fold, &size);
+		e = _fatnameindexfind(x, key, utf8hash(key));
+		if (e != NULL && e->longcluster == longdirectory->n &&
+		    e->longindex == longindex) {
+			_fatnameindexdelete(f, x, e);
+			_fatnameindexunlink(x, e);
+		}
+	}
+	free(name);
+	free(fold);
 }
 
 /*
@@ -327,7 +1116,8 @@ int _fatwcscmp(fat *f, const char *a, const char *b) {
 int fatlookupfilelongboth(fat *f, int32_t dir, char *name,
 		unit **directory, int *index,
 		unit **longdirectory, int *longindex) {
-	char *sname;
+	char *sname, *key, *fold;
+	size_t size;
 	int32_t cl;
 	int res;
 
@@ -342,21 +1132,39 @@ int fatlookupfilelongboth(fat *f, int32_t dir, char *name,
 		return ! (res & FAT_SHORT);
 	}
 
+	if (f->nameindex != NULL) {
+		res = _fatnameindexlookup(f, dir, name,
+			directory, index, longdirectory, longindex);
+		if (res != 1) {
+			dprintf(res == 0 ? " (indexed)\n" : " (not indexed)\n");
+			return res;
+		}
+	}
+
 	*directory = fatclusterread(f, dir);
 
+	fold = NULL;
+	size = 0;
+	key = _fatnamekey(f->insensitive, name, &fold, &size);
+
+	res = -1;
 	for (*index = 0;
 	     fatlongnext(f, directory, index,
 	     		longdirectory, longindex, &sname) != FAT_END;
 	     fatnextentry(f, directory, index)) {
 		dprintf(" %s", sname);
-		if (! _fatwcscmp(f, name, sname)) {
-			dprintf(" <- (found)\n");
-			free(sname);
-			return 0;
-		}
+		res = (f->insensitive ?
+			utf8foldedcmp(key, sname) : strcmp(key, sname)) ? -1 : 0;
 		free(sname);
+		if (res == 0)
+			break;
 	}
 
+	free(fold);
+	if (res == 0) {
+		dprintf(" <- (found)\n");
+		return 0;
+	}
 	dprintf(" (not found)\n");
 	*directory = NULL;
 	return -1;
@@ -391,7 +1199,7 @@ int32_t fatlookupfirstclusterlong(fat *f, int32_t dir, char *name) {
 /*
  * look up a file given its path (long name) from a given directory
  */
-int fatlookuppathlongbothdir(fat *f, int32_t *dir, char *path,
+int _fatlookuppathlong(fat *f, int32_t *dir, char *path,
 		unit **directory, int *index,
 		unit **longdirectory, int *longindex) {
 	char *end, *last, *copy;
@@ -406,7 +1214,7 @@ int fatlookuppathlongbothdir(fat *f, int32_t *dir, char *path,
 			directory, index, longdirectory, longindex);
 
 	if (end == path)
-		return fatlookuppathlongbothdir(f, dir, path + 1,
+		return _fatlookuppathlong(f, dir, path + 1,
 			directory, index, longdirectory, longindex);
 
 	for (last = end; *last == '/'; last++) {
@@ -435,7 +1243,7 @@ int fatlookuppathlongbothdir(fat *f, int32_t *dir, char *path,
 
 	dprintf("name '%s', directory: %d\n", copy, *dir);
 
-	res = fatlookuppathlongbothdir(f, dir, last,
+	res = _fatlookuppathlong(f, dir, last,
 		directory, index, longdirectory, longindex);
 
 	if (! res) {
@@ -447,6 +1255,365 @@ int fatlookuppathlongbothdir(fat *f, int32_t *dir, char *path,
 	return res;
 }
 
+/*
+ * path cache
+ *
+ * the result of looking up a path from a directory: whether it exists, the
+ * directory that contains it and the position of its entries; the leading
+ * directories of the path are cached as well, with their first cluster, so
+ * that paths in the same directory share them; an entry found is checked
+ * against the directory and against its leading directories, and looked up
+ * again if they changed; paths not found are forgotten when a file is created,
+ * the paths of a file when it is deleted, all of them when clusters are moved
+ */
+
+#define PATHCACHE_SIZE 256
+
+struct fatpathentry {
+	int32_t dir;			/* start directory */
+	int file;			/* the file, or the leading directory */
+	char *path;			/* parts separated by single slashes,
+					   NULL = unused slot */
+	int len;
+	uint32_t hash;
+	int found;
+	int32_t parent;			/* directory containing the last part */
+	int32_t target;			/* first cluster, for directories */
+	struct fatnameentry entry;	/* position of the entries */
+	uint64_t used;
+	int next;			/* next in the bucket, -1 = none */
+};
+
+struct fatpathcache {
+	int insensitive;
+	uint64_t used;
+	int buckets[PATHCACHE_SIZE];
+	struct fatpathentry entries[PATHCACHE_SIZE];
+};
+
+void _fatpathcacheunlink(struct fatpathcache *c, struct fatpathentry *e) {
+	int *i;
+
+	for (i = c->buckets + e->hash % PATHCACHE_SIZE;
+	     *i != -1;
+	     i = & c->entries[*i].next)
+		if (c->entries + *i == e) {
+			*i = e->next;
+			break;
+		}
+	free(e->path);
+	e->path = NULL;
+}
+
+void fatsetpathcache(fat *f, int on) {
+	int i;
+
+	if (on && f->pathcache == NULL) {
+		f->pathcache = calloc(1, sizeof(struct fatpathcache));
+		if (f->pathcache == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		for (i = 0; i < PATHCACHE_SIZE; i++)
+			f->pathcache->buckets[i] = -1;
+	}
+
+	if (! on && f->pathcache != NULL) {
+		fatpathcacheforget(f, 1);
+		free(f->pathcache);
+		f->pathcache = NULL;
+	}
+}
+
+/*
+ * forget the paths: all, or only the ones not found
+ */
+void fatpathcacheforget(fat *f, int all) {
+	struct fatpathentry *e;
+	int i;
+
+	if (f->pathcache == NULL)
+		return;
+
+	for (i = 0; i < PATHCACHE_SIZE; i++) {
+		e = f->pathcache->entries + i;
+		if (e->path != NULL && (all || ! e->found))
+			_fatpathcacheunlink(f->pathcache, e);
+	}
+}
+
+/*
+ * forget the paths that lead to the file at longdirectory,longindex
+ */
+void _fatpathcacheremove(fat *f, unit *longdirectory, int longindex) {
+	struct fatpathentry *e;
+	int i;
+
+	if (f->pathcache == NULL)
+		return;
+
+	for (i = 0; i < PATHCACHE_SIZE; i++) {
+		e = f->pathcache->entries + i;
+		if (e->path != NULL && e->found &&
+		    e->entry.longcluster == longdirectory->n &&
+		    e->entry.longindex == longindex)
+			_fatpathcacheunlink(f->pathcache, e);
+	}
+}
+
+uint32_t _fatpathhash(int32_t dir, int file, const char *path, int len) {
+	uint32_t hash;
+	int i;
+
+	hash = 2166136261u ^ (uint32_t) dir ^ ((uint32_t) file << 31);
+	for (i = 0; i < len; i++)
+		hash = (hash ^ (unsigned char) path[i]) * 16777619u;
+	return hash;
+}
+
+struct fatpathentry *_fatpathcachefind(struct fatpathcache *c,
+		int32_t dir, int file, const char *path, int len,
+		uint32_t hash) {
+	struct fatpathentry *e;
+	int i;
+
+	for (i = c->buckets[hash % PATHCACHE_SIZE]; i != -1; i = e->next) {
+		e = c->entries + i;
+		if (e->hash == hash && e->dir == dir && e->file == file &&
+		    e->len == len && ! memcmp(e->path, path, len))
+			return e;
+	}
+	return NULL;
+}
+
+/*
+ * add a path, replacing the one used least recently if the cache is full
+ */
+struct fatpathentry *_fatpathcacheadd(struct fatpathcache *c,
+		int32_t dir, int file, const char *path, int len,
+		uint32_t hash) {
+	struct fatpathentry *e;
+	int i, b;
+
+	e = NULL;
+	for (i = 0; i < PATHCACHE_SIZE; i++) {
+		if (c->entries[i].path == NULL) {
+			e = c->entries + i;
+			break;
+		}
+		if (e == NULL || c->entries[i].used < e->used)
+			e = c->entries + i;
+	}
+	if (e->path != NULL)
+		_fatpathcacheunlink(c, e);
+
+	e->dir = dir;
+	e->file = file;
+	e->path = malloc(len + 1);
+	if (e->path == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	memcpy(e->path, path, len);
+	e->path[len] = '\0';
+	e->len = len;
+	e->hash = hash;
+	e->found = 0;
+	e->parent = FAT_ERR;
+	e->target = FAT_ERR;
+	e->used = ++c->used;
+
+	b = hash % PATHCACHE_SIZE;
+	e->next = c->buckets[b];
+	c->buckets[b] = e - c->entries;
+	return e;
+}
+
+/*
+ * the first cluster of the directory made by the first n parts of a path, or
+ * FAT_ERR; normalized is the path with single slashes, parts the same with
+ * zeros in place of the slashes, start[i] the start of each part
+ */
+int32_t _fatpathcachedir(fat *f, int32_t dir,
+		char *normalized, char *parts, int *start, int n) {
+	struct fatpathcache *c;
+	struct fatpathentry *e;
+	unit *directory, *longdirectory;
+	int index, longindex;
+	int32_t parent, target;
+	uint32_t hash;
+	int len, res;
+
+	if (n == 0)
+		return dir;
+
+	c = f->pathcache;
+	parent = _fatpathcachedir(f, dir, normalized, parts, start, n - 1);
+
+	len = start[n] - 1;
+	hash = _fatpathhash(dir, 0, normalized, len);
+	e = _fatpathcachefind(c, dir, 0, normalized, len, hash);
+	if (e != NULL && e->parent == parent && ! e->found) {
+		e->used = ++c->used;
+		return FAT_ERR;
+	}
+	if (e != NULL && e->parent == parent &&
+	    ! _fatnameindexcheck(f, &e->entry,
+	    		&directory, &index, &longdirectory, &longindex)) {
+		target = fatentrygetfirstcluster(directory, index, fatbits(f));
+		if (target == 0)
+			target = fatgetrootbegin(f);
+		if (target == e->target) {
+			e->used = ++c->used;
+			return target;
+		}
+	}
+	if (e != NULL)
+		_fatpathcacheunlink(c, e);
+
+	if (parent == FAT_ERR)
+		res = -1;
+	else
+		res = fatlookupfilelongboth(f, parent, parts + start[n - 1],
+			&directory, &index, &longdirectory, &longindex);
+	if (res)
+		target = FAT_ERR;
+	else {
+		target = fatentrygetfirstcluster(directory, index, fatbits(f));
+		if (target == 0)
+			target = fatgetrootbegin(f);
+	}
+
+	dprintf("cache directory '%s': %d\n", parts + start[n - 1], target);
+	e = _fatpathcacheadd(c, dir, 0, normalized, len, hash);
+	e->parent = parent;
+	e->target = target;
+	if (target != FAT_ERR) {
+		e->found = 1;
+		_fatnameentryset(&e->entry,
+			directory, index, longdirectory, longindex);
+	}
+	return target;
+}
+
+int _fatpathcachelookup(fat *f, int32_t *dir, char *path,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex) {
+	struct fatpathcache *c;
+	struct fatpathentry *e;
+	char *normalized, *parts, *p;
+	int *start;
+	int n, len, res;
+	int32_t from, parent;
+	uint32_t hash;
+
+	c = f->pathcache;
+	from = *dir;
+	if (c->insensitive != f->insensitive) {
+		fatpathcacheforget(f, 1);
+		c->insensitive = f->insensitive;
+	}
+
+	len = strlen(path);
+	normalized = malloc(2 * (len + 1));
+	start = malloc((len / 2 + 2) * sizeof(int));
+	if (normalized == NULL || start == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	parts = normalized + len + 1;
+
+	n = 0;
+	len = 0;
+	for (p = path; *p != '\0'; ) {
+		for (; *p == '/'; p++) {
+		}
+		if (*p == '\0')
+			break;
+		if (n > 0)
+			normalized[len++] = '/';
+		start[n++] = len;
+		for (; *p != '\0' && *p != '/'; p++)
+			normalized[len++] = *p;
+	}
+	normalized[len] = '\0';
+	start[n] = len + 1;
+
+	if (n == 0) {
+		free(normalized);
+		free(start);
+		return _fatlookuppathlong(f, dir, path,
+			directory, index, longdirectory, longindex);
+	}
+
+	memcpy(parts, normalized, len + 1);
+	for (p = parts; p < parts + len; p++)
+		if (*p == '/')
+			*p = '\0';
+
+	parent = _fatpathcachedir(f, from, normalized, parts, start, n - 1);
+
+	hash = _fatpathhash(from, 1, normalized, len);
+	e = _fatpathcachefind(c, from, 1, normalized, len, hash);
+	if (e != NULL && e->parent == parent && ! e->found) {
+		e->used = ++c->used;
+		dprintf("%s (cached, not found)\n", normalized);
+		*dir = parent;
+		*directory = NULL;
+		free(normalized);
+		free(start);
+		return -1;
+	}
+	if (e != NULL && e->parent == parent &&
+	    ! _fatnameindexcheck(f, &e->entry,
+	    		directory, index, longdirectory, longindex)) {
+		e->used = ++c->used;
+		dprintf("%s (cached)\n", normalized);
+		*dir = parent;
+		free(normalized);
+		free(start);
+		return 0;
+	}
+	if (e != NULL)
+		_fatpathcacheunlink(c, e);
+
+	*dir = parent;
+	if (parent == FAT_ERR) {
+		dprintf("part of path not found: '%s'\n", normalized);
+		*directory = NULL;
+		res = -1;
+	}
+	else
+		res = fatlookupfilelongboth(f, parent, parts + start[n - 1],
+			directory, index, longdirectory, longindex);
+
+	e = _fatpathcacheadd(c, from, 1, normalized, len, hash);
+	e->parent = parent;
+	if (! res) {
+		e->found = 1;
+		_fatnameentryset(&e->entry,
+			*directory, *index, *longdirectory, *longindex);
+	}
+
+	free(normalized);
+	free(start);
+	return res;
+}
+
+/*
+ * look up a file given its path (long name) from a given directory
+ */
+int fatlookuppathlongbothdir(fat *f, int32_t *dir, char *path,
+		unit **directory, int *index,
+		unit **longdirectory, int *longindex) {
+	if (f->pathcache != NULL && strchr(path, ':') == NULL)
+		return _fatpathcachelookup(f, dir, path,
+			directory, index, longdirectory, longindex);
+
+	return _fatlookuppathlong(f, dir, path,
+		directory, index, longdirectory, longindex);
+}
+
 int fatlookuppathlongdir(fat *f, int32_t *dir, char *path,
 		unit **directory, int *index) {
 	unit *longdirectory;
@@ -494,7 +1661,7 @@ int32_t fatlookuppathfirstclusterlong(fat *f, int32_t dir, char *path) {
 /*
  * find the first sequence of len free directory entries
  */
-int fatfindfreelong(fat *f, int len, unit **directory, int *index,
+int _fatfindfreelong(fat *f, int len, unit **directory, int *index,
 		unit **startdirectory, int *startindex) {
 	int consecutive;
 	unit *nextdirectory;
@@ -524,6 +1691,52 @@ int fatfindfreelong(fat *f, int len, unit **directory, int *index,
 	return 0;
 }
 
+/*
+ * same, from the map of the free slots if the directory is indexed; the
+ * entries found are taken as used from now on
+ */
+int fatfindfreelong(fat *f, int len, unit **directory, int *index,
+		unit **startdirectory, int *startindex) {
+	struct fatnameindex *x;
+	int start, res;
+
+	x = NULL;
+	if (f->nameindex != NULL && *index == -1)
+		x = _fatnameindexget(f, (*directory)->n, 1);
+	if (x != NULL && ! x->freeknown)
+		_fatfreeslotsbuild(f, x);
+	if (x == NULL || ! x->freeknown)
+		return _fatfindfreelong(f, len, directory, index,
+			startdirectory, startindex);
+
+	start = _fatfreeslotsfind(f, x, len);
+	dprintf("free slots from %d\n", start);
+	if (start > 0) {
+		*directory = fatclusterread(f,
+			x->clusters[(start - 1) / x->perunit]);
+		*index = (start - 1) % x->perunit;
+		if (*directory == NULL)
+			return -1;
+	}
+
+	res = _fatfindfreelong(f, len, directory, index,
+		startdirectory, startindex);
+	if (res) {
+		x->freeknown = 0;
+		return res;
+	}
+
+	_fatfreeslotsgrow(f, x);
+	if (_fatfreeslotsposition(x, (*startdirectory)->n, *startindex) !=
+			start) {
+		dprintf("free slots of directory %d out of date\n", x->dir);
+		x->freeknown = 0;
+		return 0;
+	}
+	_fatfreeslotsuse(x, start, len);
+	return 0;
+}
+
 /*
  * find the first sequence of len free entries in a directory given by path
  */
@@ -762,6 +1975,8 @@ int fatcreatefileshortlong(fat *f, int32_t dir,
 	fatentrysetsize(*directory, *index, 0);
 	fatentrysetfirstcluster(*directory, *index, f->bits, FAT_UNUSED);
 
+	_fatnameindexinsert(f, dir, *startdirectory, *startindex);
+	fatpathcacheforget(f, 0);
 	return 0;
 }
 
@@ -839,9 +2054,19 @@ int _fatshorttoshort(char *name,
 }
 
 int _fatshortexists(fat *f, int32_t dir, unsigned char shortname[11]) {
+	struct fatnameindex *x;
 	unit *directory;
 	int index;
 
+	x = f->nameindex == NULL ? NULL : _fatnameindexget(f, dir, 1);
+	if (x != NULL && ! x->shortknown)
+		_fatshortnamesbuild(f, x);
+	if (x != NULL && x->shortknown) {
+		_fatnameindexdeleted(f, x);
+		return _fatshortnamesfind(x, shortname,
+			_fatshortnameshash(shortname)) != NULL;
+	}
+
 	directory = fatclusterread(f, dir);
 	if (directory == NULL)
 		return 0;
@@ -858,7 +2083,8 @@ int _fatlongtoshort(fat *f, int32_t dir, char *name,
 		unsigned char shortname[11]) {
 	unsigned char stem[11], num[11];
 	char *dot;
-	int i, n;
+	int i, n, hashed;
+	uint32_t hash;
 
 	memset(stem, ' ', 11);
 	fatutf8tochar((char *) stem, name, 8, NULL);
@@ -882,7 +2108,16 @@ int _fatlongtoshort(fat *f, int32_t dir, char *name,
 	if (_fatshortexists(f, dir, shortname) == 0)
 		return 0;
 
-	for (n = 1; n < 99999; n++) {
+	for (n = 1, hashed = 0; n < 99999; n++) {
+		/* after ~4, two characters and a checksum of the long name */
+		if (n == 5 && ! hashed) {
+			hash = utf8hash(name);
+			sprintf((char *) num, "%04X", (hash ^ hash >> 16) & 0xFFFF);
+			memcpy(stem + 2, num, 4);
+			hashed = 1;
+			n = 1;
+		}
+
 		sprintf((char *) num, "%+8d", n);
 
 		for (i = 0; i < 11; i++)
@@ -1006,6 +2241,9 @@ int fatdeletelong(fat *f, unit *directory, int index) {
 	struct fatlongscan scan;
 	int res, lastn;
 
+	_fatnameindexremove(f, directory, index);
+	_fatpathcacheremove(f, directory, index);
+
 	lastn = -1;
 	for (fatlonginit(&scan);
 	     (res = fatlongscan(directory, index, &scan)) & FAT_LONG_SOME;
@@ -59,6 +59,22 @@ int fatlookupfilelong(fat *f, int32_t dir, char *name,
 		unit **directory, int *index);
 int32_t fatlookupfirstclusterlong(fat *f, int32_t dir, char *name);
 
+/*
+ * index the names, the short names and the free entries in the directories,
+ * to look them up in constant time; forget the index of a directory (-1 = all)
+ * changed in ways other than fatcreatefile...() and fatdeletelong()
+ */
+void fatsetnameindex(fat *f, int on);
+void fatnameindexforget(fat *f, int32_t dir);
+
+/*
+ * cache the paths looked up; forget all of them or only the ones not found
+ * when directories change in ways other than fatcreatefile...() and
+ * fatdeletelong()
+ */
+void fatsetpathcache(fat *f, int on);
+void fatpathcacheforget(fat *f, int all);
+
 /*
  * path lookup
  */
@@ -53,6 +53,8 @@
 #include "entry.h"
 #include "table.h"
 #include "unit.h"
+#include "inverse.h"
+#include "long.h"
 
 int fatreferencedebug = 0;
 #define dprintf if (fatreferencedebug) printf
@@ -231,6 +233,11 @@ int fatclustermove(fat *f,
         if (newt != current)
 		fatsetnextcluster(f, current, FAT_UNUSED);
 
+			/* directory entries may have moved */
+
+	fatnameindexforget(f, -1);
+	fatpathcacheforget(f, 1);
+
 	return 0;
 }
 
@@ -301,6 +308,11 @@ int fatclusterswap(fat *f,
 	fatsetnextcluster(f, numsecond, nextfirst);
 	fatsetnextcluster(f, numfirst, nextsecond);
 
+			/* directory entries may have moved */
+
+	fatnameindexforget(f, -1);
+	fatpathcacheforget(f, 1);
+
 	return 0;
 }
 
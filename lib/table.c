@@ -41,6 +41,8 @@ int fattabledebug = 0;
 int fattableerror = 1;
 #define eprintf if (fattableerror) printf
 
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
 /*
  * read a whole FAT in cache; read all FATs if nfat == FAT_ALL
  */
@@ -76,18 +78,445 @@ int fatreadfat(fat *f, int nfat) {
 }
 
 /*
- * the entry for a cluster in a fat: sector and position within
+ * read in cache the sectors from the first to the last of a fat, by vectored
+ * reads of the sequences of them that are not already cached; a long sequence
+ * takes several reads, since fatunitgetrun() reads at most IOV_MAX units
+ */
+void _fatreadsectors(fat *f, int nfat, int32_t from, int32_t to) {
+	int32_t start, sector, run, done;
+	int bytes, res;
+
+	bytes = fatgetbytespersector(f);
+	start = fatgetreservedsectors(f) + nfat * fatgetfatsize(f);
+	if (to > fatgetfatsize(f) - 1)
+		to = fatgetfatsize(f) - 1;
+
+	for (sector = start + from; sector <= start + to; sector += run) {
+		run = 1;
+		if (fatunitcached(f->sectors, sector))
+			continue;
+		while (sector + run <= start + to &&
+		       ! fatunitcached(f->sectors, sector + run))
+			run++;
+		for (done = 0; done < run - 1; done += res) {
+			res = fatunitgetrun(&f->sectors, f->offset, bytes,
+				sector + done, run - done, f->fd);
+			if (res <= 0)
+				break;
+		}
+	}
+}
+
+/*
+ * read in cache the sectors of a fat that contain a range of entries
+ */
+void _fatreadentries(fat *f, int nfat, int32_t first, int32_t count) {
+	int bytes;
+
+	bytes = fatgetbytespersector(f);
+	_fatreadsectors(f, nfat,
+		((int64_t) first) * fatbits(f) / 8 / bytes,
+		((((int64_t) first) + count) * fatbits(f) / 8 + 1) / bytes);
+}
+
+/*
+ * deferred mirroring: the range of bytes changed in each sector of the first
+ * fat since the last copy to the other fats
+ */
+
+void fatsetmirror(fat *f, int mirror) {
+	if (! mirror)
+		fatmirrorfats(f);
+	f->mirror = mirror;
+}
+
+void _fatmirrormark(fat *f, int32_t n) {
+	int64_t first, last;
+	int32_t s;
+	int bytes, b, e;
+
+	if (f->mirrorrange == NULL) {
+		f->mirrorsize = fatgetfatsize(f);
+		f->mirrorrange = malloc(f->mirrorsize * 2 * sizeof(int));
+		if (f->mirrorrange == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		for (s = 0; s < f->mirrorsize; s++)
+			f->mirrorrange[s * 2] = -1;
+	}
+
+	bytes = fatgetbytespersector(f);
+	first = ((int64_t) n) * fatbits(f) / 8;
+	last = (((int64_t) n) * fatbits(f) + fatbits(f) - 1) / 8;
+	for (s = first / bytes; s <= last / bytes && s < f->mirrorsize; s++) {
+		b = first > s * bytes ? first - s * bytes : 0;
+		e = MIN(last - s * bytes + 1, bytes);
+		if (f->mirrorrange[s * 2] == -1) {
+			f->mirrorrange[s * 2] = b;
+			f->mirrorrange[s * 2 + 1] = e;
+			continue;
+		}
+		f->mirrorrange[s * 2] = MIN(f->mirrorrange[s * 2], b);
+		if (f->mirrorrange[s * 2 + 1] < e)
+			f->mirrorrange[s * 2 + 1] = e;
+	}
+}
+
+int fatmirrorfats(fat *f) {
+	int32_t s, run, i;
+	int nfat, bytes, b, e, res = 0;
+	unit *u0, *u;
+
+	if (f->mirrorrange == NULL)
+		return 0;
+
+	bytes = fatgetbytespersector(f);
+	for (s = 0; s < f->mirrorsize; s += run) {
+		run = 1;
+		if (f->mirrorrange[s * 2] == -1)
+			continue;
+		while (s + run < f->mirrorsize &&
+		       f->mirrorrange[(s + run) * 2] != -1)
+			run++;
+		dprintf("mirroring FAT0 sectors %d - %d\n", s, s + run - 1);
+
+		_fatreadsectors(f, 0, s, s + run - 1);
+		for (nfat = 1; nfat < fatgetnumfats(f); nfat++) {
+			_fatreadsectors(f, nfat, s, s + run - 1);
+			for (i = s; i < s + run; i++) {
+				u0 = fatunitget(&f->sectors, f->offset, bytes,
+					fatgetreservedsectors(f) + i, f->fd);
+				u = fatunitget(&f->sectors, f->offset, bytes,
+					fatgetreservedsectors(f) +
+					nfat * fatgetfatsize(f) + i, f->fd);
+				if (u0 == NULL || u == NULL) {
+					res = -1;
+					continue;
+				}
+				b = f->mirrorrange[i * 2];
+				e = f->mirrorrange[i * 2 + 1];
+				memcpy(fatunitgetdata(u) + b,
+					fatunitgetdata(u0) + b, e - b);
+				fatunitdirty(u, b, e - b);
+			}
+		}
+	}
+
+	free(f->mirrorrange);
+	f->mirrorrange = NULL;
+	f->mirrorsize = 0;
+	return res;
+}
+
+/*
+ * decode a whole FAT in memory, f->readahead bytes of it at time
+ */
+int fatdecodefat(fat *f, int nfat) {
+	const fatwidth *w;
+	int32_t entries, step, first, count;
+
+	w = fatgetwidth(f);
+	if (nfat < 0 || nfat >= fatgetnumfats(f) || w == NULL)
+		return -1;
+
+	fatdecodefree(f);
+
+	entries = ((uint64_t) fatgetfatsize(f)) *
+		fatgetbytespersector(f) * 8 / w->bits;
+	if (entries > fatlastcluster(f) + 1)
+		entries = fatlastcluster(f) + 1;
+	dprintf("decoding FAT%d: %d entries\n", nfat, entries);
+
+	f->decoded = malloc(entries * sizeof(uint32_t));
+	if (f->decoded == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	step = ((int64_t) f->readahead) * 8 / w->bits / 2 * 2;
+	if (step < 2)
+		step = 2;
+	for (first = 0; first < entries; first += step) {
+		count = MIN(step, entries - first);
+		_fatreadentries(f, nfat, first, count);
+		if (w->getrange(f, nfat, first, count, f->decoded + first)) {
+			dprintf("error decoding FAT%d\n", nfat);
+			fatdecodefree(f);
+			return -1;
+		}
+	}
+
+	f->decodedfat = nfat;
+	f->decodedsize = entries;
+	return 0;
+}
+
+void fatdecodefree(fat *f) {
+	free(f->decoded);
+	f->decoded = NULL;
+	f->decodedfat = FAT_ALL;
+	f->decodedsize = 0;
+}
+
+/*
+ * a fat as runs of entries: in a sequential run each cluster is followed by
+ * the next and the last by value; in a constant run all entries are value,
+ * like an area of unused clusters; the runs are sorted by their start and
+ * cover all entries, so an entry is found by a binary search
+ *
+ * the array has a gap at the position of the last change, so that changes
+ * close to each other (like allocating a file) do not move the whole array
  */
 
-unit *_fatclusterpos(fat *f, int nfat, int32_t n, int *pcluster) {
+struct fatrun {
+	int32_t start;
+	int32_t length;
+	uint32_t value;
+	int sequential;
+};
+
+struct fatrun *_fatrunat(fat *f, int32_t i) {
+	return f->runs + (i < f->runsgap ? i : i + f->maxruns - f->nruns);
+}
+
+uint32_t _fatrunentry(struct fatrun *r, int32_t n) {
+	return r->sequential && n < r->start + r->length - 1 ?
+		(uint32_t) n + 1 : r->value;
+}
+
+int32_t _fatrunsfind(fat *f, int32_t n) {
+	int32_t low, high, mid;
+
+	low = 0;
+	high = f->nruns - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (_fatrunat(f, mid)->start <= n)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+
+/*
+ * join b to a if they form a single run
+ */
+int _fatrunjoin(struct fatrun *a, struct fatrun *b) {
+	if ((a->sequential || a->length == 1) &&
+	    (b->sequential || b->length == 1) &&
+	    a->value == (uint32_t) b->start) {
+		a->length += b->length;
+		a->value = b->value;
+		a->sequential = 1;
+		return 1;
+	}
+	if ((! a->sequential || a->length == 1) &&
+	    (! b->sequential || b->length == 1) &&
+	    a->value == b->value) {
+		a->length += b->length;
+		a->sequential = 0;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * replace runs from to to with the num runs in new, joining them first
+ */
+void _fatrunsreplace(fat *f, int32_t from, int32_t to,
+		struct fatrun *new, int num) {
+	int32_t gap, tail, max;
+	int i, j;
+
+	for (i = 0, j = 1; j < num; j++)
+		if (! _fatrunjoin(&new[i], &new[j]))
+			new[++i] = new[j];
+	num = num == 0 ? 0 : i + 1;
+
+	gap = f->maxruns - f->nruns;
+	if (f->runsgap < to + 1)
+		memmove(f->runs + f->runsgap, f->runs + f->runsgap + gap,
+			(to + 1 - f->runsgap) * sizeof(struct fatrun));
+	else if (f->runsgap > to + 1)
+		memmove(f->runs + to + 1 + gap, f->runs + to + 1,
+			(f->runsgap - to - 1) * sizeof(struct fatrun));
+	f->nruns -= to - from + 1;
+	f->runsgap = from;
+
+	if (f->maxruns - f->nruns < num) {
+		tail = f->nruns - f->runsgap;
+		max = f->maxruns * 2 + num;
+		f->runs = realloc(f->runs, max * sizeof(struct fatrun));
+		if (f->runs == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		memmove(f->runs + max - tail, f->runs + f->maxruns - tail,
+			tail * sizeof(struct fatrun));
+		f->maxruns = max;
+	}
+
+	memcpy(f->runs + from, new, num * sizeof(struct fatrun));
+	f->nruns += num;
+	f->runsgap = from + num;
+}
+
+/*
+ * change an entry in the runs
+ */
+void _fatrunsset(fat *f, int32_t n, uint32_t next) {
+	struct fatrun r, new[5];
+	int32_t i, from, to;
+	int num;
+
+	i = _fatrunsfind(f, n);
+	r = *_fatrunat(f, i);
+	if (_fatrunentry(&r, n) == next)
+		return;
+
+	from = i > 0 ? i - 1 : i;
+	to = i < f->nruns - 1 ? i + 1 : i;
+	num = 0;
+	if (from < i)
+		new[num++] = *_fatrunat(f, from);
+	if (n > r.start) {
+		new[num] = r;
+		new[num].length = n - r.start;
+		if (r.sequential)
+			new[num].value = n;
+		num++;
+	}
+	new[num].start = n;
+	new[num].length = 1;
+	new[num].value = next;
+	new[num].sequential = 0;
+	num++;
+	if (n < r.start + r.length - 1) {
+		new[num] = r;
+		new[num].start = n + 1;
+		new[num].length = r.start + r.length - 1 - n;
+		num++;
+	}
+	if (to > i)
+		new[num++] = *_fatrunat(f, to);
+
+	_fatrunsreplace(f, from, to, new, num);
+}
+
+/*
+ * all entries from a cluster on become unused
+ */
+void _fatrunsclear(fat *f, int32_t n) {
+	struct fatrun new[2];
+	int32_t i;
+	int num = 0;
+
+	if (n >= f->runssize)
+		return;
+	i = _fatrunsfind(f, n);
+	new[0] = *_fatrunat(f, i);
+	if (n > new[0].start) {
+		new[0].length = n - new[0].start;
+		if (new[0].sequential)
+			new[0].value = n;
+		num++;
+	}
+	new[num].start = n;
+	new[num].length = f->runssize - n;
+	new[num].value = FAT_UNUSED;
+	new[num].sequential = 0;
+	num++;
+	_fatrunsreplace(f, i, f->nruns - 1, new, num);
+}
+
+/*
+ * compress a whole fat in memory as runs; fatgetfat() on it takes entries
+ * from the runs, fatsetfat() updates them
+ */
+int fatcompressfat(fat *f, int nfat) {
+	const fatwidth *w;
+	uint32_t *entries;
+	int32_t size, step, first, count, i;
+	struct fatrun new[2];
+
+	w = fatgetwidth(f);
+	if (nfat < 0 || nfat >= fatgetnumfats(f) || w == NULL)
+		return -1;
+
+	fatcompressfree(f);
+
+	size = ((uint64_t) fatgetfatsize(f)) *
+		fatgetbytespersector(f) * 8 / w->bits;
+	if (size > fatlastcluster(f) + 1)
+		size = fatlastcluster(f) + 1;
+
+	step = ((int64_t) f->readahead) * 8 / w->bits / 2 * 2;
+	if (step < 2)
+		step = 2;
+	entries = malloc(step * sizeof(uint32_t));
+	if (entries == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	for (first = 0; first < size; first += count) {
+		count = MIN(step, size - first);
+		_fatreadentries(f, nfat, first, count);
+		if (w->getrange(f, nfat, first, count, entries)) {
+			dprintf("error compressing FAT%d\n", nfat);
+			free(entries);
+			fatcompressfree(f);
+			return -1;
+		}
+		for (i = 0; i < count; i++) {
+			new[1].start = first + i;
+			new[1].length = 1;
+			new[1].value = entries[i];
+			new[1].sequential = 0;
+			if (f->nruns == 0)
+				_fatrunsreplace(f, 0, -1, new + 1, 1);
+			else {
+				new[0] = *_fatrunat(f, f->nruns - 1);
+				_fatrunsreplace(f, f->nruns - 1, f->nruns - 1,
+					new, 2);
+			}
+		}
+	}
+	free(entries);
+
+	f->runsfat = nfat;
+	f->runssize = size;
+	dprintf("compressed FAT%d: %d entries in %d runs\n",
+		nfat, size, f->nruns);
+	return 0;
+}
+
+void fatcompressfree(fat *f) {
+	free(f->runs);
+	f->runs = NULL;
+	f->nruns = 0;
+	f->maxruns = 0;
+	f->runsgap = 0;
+	f->runsfat = FAT_ALL;
+	f->runssize = 0;
+}
+
+/*
+ * the entry for a cluster in a fat: sector and position within; offset is the
+ * position of the entry in the fat, in bytes
+ */
+
+unit *_fatclusterpos(fat *f, int nfat, int32_t n, int64_t offset,
+		int *pcluster) {
 	int fatbegin, nsector;
 	unit *ret;
 
 	fatbegin = fatgetreservedsectors(f) + nfat * fatgetfatsize(f);
 
-	*pcluster = n * (fatbits(f) / 4) / 2;
-	nsector = *pcluster / fatgetbytespersector(f);
-	*pcluster -= nsector * fatgetbytespersector(f);
+	nsector = offset / fatgetbytespersector(f);
+	*pcluster = offset - ((int64_t) nsector) * fatgetbytespersector(f);
 
 	ret = fatunitget(&f->sectors, f->offset, fatgetbytespersector(f),
 		fatbegin + nsector, f->fd);
@@ -97,145 +526,959 @@ unit *_fatclusterpos(fat *f, int nfat, int32_t n, int *pcluster) {
 		printf("(sector %d of FAT%d)\n",  nsector, nfat);
 		// exit(1);
 	}
-	return ret;
+	return ret;
+}
+
+/*
+ * on fat12, two fat entries take three bytes; for example, if the first two
+ * clusters have sucessors 2->ABC and 3->123, the beginning of the table is:
+ *
+ *    F8 FF FF   BC 3A 12
+ * next of 2:    **  *
+ * next of 3:       *  **
+ *
+ * each entry spans two bytes; the formulae take these two bytes in reverse
+ * order, since this way the entries are easier to separate: BC 3A 12 becomes
+ * 12 3A BC, which is 3A BC for the first entry and 12 3A for the second
+ *
+ * the second byte for an entry may fall in the next fat sector; for this
+ * reason, the two bytes have to be read individually, rather than as a single
+ * 16-bit integer
+ */
+
+/*
+ * next byte for a fat12 entry: it may be in the next sector
+ * nfat is not needed because the sector to possibly load is just fs->n + 1
+ */
+
+unit *_fatclusterposnext(fat *f, unit *fs, int low, int *high) {
+	if (low != fatgetbytespersector(f) - 1) {
+		*high = low + 1;
+		return fs;
+	}
+
+	*high = 0;
+	return fatunitget(&f->sectors, f->offset, fatgetbytespersector(f),
+		fs->n + 1, f->fd);
+}
+
+/*
+ * bitmap of the free clusters: bit n is set if cluster n is free in the fat
+ * used for reading; it is filled lazily, in blocks of FREEMAP_BLOCK clusters
+ * the first time each is needed, and then kept in sync by fatsetfat(); it is
+ * rebuilt if the fat used for reading or the number of clusters change
+ */
+
+#define FREEMAP_BLOCK 4096
+#define FREEMAP_WORDS (FREEMAP_BLOCK / 64)
+
+void _fatfreemapdestroy(fat *f) {
+	free(f->freemap);
+	free(f->freemapknown);
+	free(f->extents);
+	f->freemap = NULL;
+	f->freemapknown = NULL;
+	f->extents = NULL;
+	f->extentsleaves = 0;
+	f->freemapfat = FAT_ALL;
+	f->freemapsize = 0;
+}
+
+void _fatfreemapcreate(fat *f) {
+	int32_t blocks;
+
+	_fatfreemapdestroy(f);
+
+	f->freemapfat = f->nfat == FAT_ALL ? 0 : f->nfat;
+	f->freemapsize = fatlastcluster(f) + 1;
+	blocks = (f->freemapsize + FREEMAP_BLOCK - 1) / FREEMAP_BLOCK;
+	dprintf("free cluster bitmap of FAT%d: %d blocks\n",
+		f->freemapfat, blocks);
+
+	f->freemap = calloc(blocks * FREEMAP_WORDS, sizeof(uint64_t));
+	f->freemapknown = calloc(blocks, 1);
+	if (f->freemap == NULL || f->freemapknown == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+}
+
+uint64_t _fatfreemapword(fat *f, int32_t w) {
+	int32_t block, cl, first, last, count, next;
+	int32_t entries[FREEMAP_BLOCK];
+	uint64_t *map;
+
+	if (f->freemap == NULL ||
+	    f->freemapfat != (f->nfat == FAT_ALL ? 0 : f->nfat) ||
+	    f->freemapsize != fatlastcluster(f) + 1)
+		_fatfreemapcreate(f);
+
+	block = w / FREEMAP_WORDS;
+	if (! f->freemapknown[block]) {
+		dprintf("filling free cluster bitmap block %d\n", block);
+		map = f->freemap + block * FREEMAP_WORDS;
+		first = block * FREEMAP_BLOCK;
+		first = first < FAT_FIRST ? FAT_FIRST : first;
+		last = block * FREEMAP_BLOCK + FREEMAP_BLOCK - 1;
+		if (last > f->freemapsize - 1)
+			last = f->freemapsize - 1;
+		count = last - first + 1;
+
+		if (fatgetfatrange(f, f->freemapfat, first, count, entries))
+			for (cl = first; cl <= last; cl++) {
+				next = fatgetnextcluster(f, cl);
+				entries[cl - first] = next == FAT_UNUSED ? 0 : 1;
+			}
+
+		for (cl = first; cl <= last; cl++)
+			if (entries[cl - first] == FAT_UNUSED)
+				map[cl / 64 % FREEMAP_WORDS] |= 1ULL << (cl % 64);
+		f->freemapknown[block] = 1;
+	}
+
+	return f->freemap[w];
+}
+
+/*
+ * number of free clusters between begin and end, with begin <= end
+ */
+int32_t _fatfreemapcount(fat *f, int32_t begin, int32_t end) {
+	int32_t w, num;
+	uint64_t word;
+
+	num = 0;
+	for (w = begin / 64; w <= end / 64; w++) {
+		word = _fatfreemapword(f, w);
+		if (w == begin / 64)
+			word &= ~0ULL << (begin % 64);
+		if (w == end / 64 && end % 64 != 63)
+			word &= (1ULL << (end % 64 + 1)) - 1;
+		num += __builtin_popcountll(word);
+	}
+	return num;
+}
+
+/*
+ * first cluster between begin and end (begin <= end) that is free or not;
+ * end + 1 if none
+ */
+int32_t _fatfreemapnext(fat *f, int32_t begin, int32_t end, int isfree) {
+	int32_t w, cl;
+	uint64_t word;
+
+	for (w = begin / 64; w <= end / 64; w++) {
+		word = _fatfreemapword(f, w);
+		if (! isfree)
+			word = ~word;
+		if (w == begin / 64)
+			word &= ~0ULL << (begin % 64);
+		if (word != 0) {
+			cl = w * 64 + __builtin_ctzll(word);
+			return cl <= end ? cl : end + 1;
+		}
+	}
+	return end + 1;
+}
+
+/*
+ * index of the free extents: a segment tree over the words of the bitmap;
+ * each node tells the number of free clusters at the start and at the end of
+ * its part of the bitmap, and the longest run of free clusters in it; the
+ * first run of a given length and the longest one in an interval are found by
+ * a descent from the root; the tree is built on the whole bitmap when first
+ * needed, then updated with it
+ */
+
+struct fatextent {
+	int32_t prefix;
+	int32_t suffix;
+	int32_t longest;
+};
+
+void _fatextentleaf(struct fatextent *e, uint64_t word, int width) {
+	uint64_t x;
+
+	if (width < 64)
+		word &= (1ULL << width) - 1;
+
+	e->prefix = ~word == 0 ? 64 : __builtin_ctzll(~word);
+	x = word << (64 - width);
+	e->suffix = ~x == 0 ? 64 : __builtin_clzll(~x);
+	for (e->longest = 0, x = word; x != 0; e->longest++)
+		x &= x << 1;
+}
+
+void _fatextentjoin(struct fatextent *e, struct fatextent *l, int32_t lwidth,
+		struct fatextent *r, int32_t rwidth) {
+	e->prefix = l->prefix == lwidth ? lwidth + r->prefix : l->prefix;
+	e->suffix = r->suffix == rwidth ? rwidth + l->suffix : r->suffix;
+	e->longest = l->suffix + r->prefix;
+	if (e->longest < l->longest)
+		e->longest = l->longest;
+	if (e->longest < r->longest)
+		e->longest = r->longest;
+}
+
+void _fatextentset(fat *f, int32_t w) {
+	int32_t node, width;
+
+	node = f->extentsleaves + w;
+	_fatextentleaf(&f->extents[node], f->freemap[w], 64);
+	for (width = 64; node > 1; width *= 2) {
+		node /= 2;
+		_fatextentjoin(&f->extents[node], &f->extents[2 * node], width,
+			&f->extents[2 * node + 1], width);
+	}
+}
+
+void _fatextentscreate(fat *f) {
+	int32_t words, w, node, level, width;
+
+	words = (f->freemapsize + 63) / 64;
+	for (w = 0; w < words; w += FREEMAP_WORDS)
+		_fatfreemapword(f, w);
+
+	for (f->extentsleaves = 1; f->extentsleaves < words; )
+		f->extentsleaves *= 2;
+	dprintf("free extents index: %d leaves\n", f->extentsleaves);
+	f->extents = calloc(2 * f->extentsleaves, sizeof(struct fatextent));
+	if (f->extents == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	for (w = 0; w < words; w++)
+		_fatextentleaf(&f->extents[f->extentsleaves + w],
+			f->freemap[w], 64);
+	for (level = f->extentsleaves / 2, width = 64;
+	     level >= 1;
+	     level /= 2, width *= 2)
+		for (node = level; node < 2 * level; node++)
+			_fatextentjoin(&f->extents[node],
+				&f->extents[2 * node], width,
+				&f->extents[2 * node + 1], width);
+}
+
+void _fatextentsget(fat *f) {
+	if (f->extents == NULL ||
+	    f->freemapfat != (f->nfat == FAT_ALL ? 0 : f->nfat) ||
+	    f->freemapsize != fatlastcluster(f) + 1) {
+		_fatfreemapword(f, 0);
+		_fatextentscreate(f);
+	}
+}
+
+/*
+ * a cluster became free or used
+ */
+void _fatfreemapupdate(fat *f, int nfat, int32_t n, int isfree) {
+	if (nfat != f->freemapfat || n < FAT_FIRST || n >= f->freemapsize ||
+	    ! f->freemapknown[n / FREEMAP_BLOCK])
+		return;
+
+	if (isfree)
+		f->freemap[n / 64] |= 1ULL << (n % 64);
+	else
+		f->freemap[n / 64] &= ~(1ULL << (n % 64));
+
+	if (f->extents != NULL)
+		_fatextentset(f, n / 64);
+}
+
+/*
+ * first run of length free clusters between begin and end, in the part of
+ * the bitmap from lo to hi covered by a node; run is the number of free
+ * clusters right before lo
+ */
+int32_t _fatextentfirst(fat *f, int32_t node, int64_t lo, int64_t hi,
+		int32_t begin, int32_t end, int length, int32_t *run) {
+	struct fatextent *e;
+	int64_t mid, c;
+
+	if (hi < begin || lo > end)
+		return FAT_ERR;
+
+	e = &f->extents[node];
+	if (begin <= lo && hi <= end &&
+	    *run + e->prefix < length && e->longest < length) {
+		*run = e->prefix == hi - lo + 1 ? *run + e->prefix : e->suffix;
+		return FAT_ERR;
+	}
+
+	if (node >= f->extentsleaves) {
+		for (c = lo > begin ? lo : begin; c <= hi && c <= end; c++) {
+			*run = f->freemap[c / 64] & (1ULL << (c % 64)) ?
+				*run + 1 : 0;
+			if (*run >= length)
+				return c - length + 1;
+		}
+		return FAT_ERR;
+	}
+
+	mid = (lo + hi) / 2;
+	c = _fatextentfirst(f, 2 * node, lo, mid, begin, end, length, run);
+	if (c != FAT_ERR)
+		return c;
+	return _fatextentfirst(f, 2 * node + 1, mid + 1, hi,
+		begin, end, length, run);
+}
+
+/*
+ * free clusters at start and end, and longest run between begin and end
+ */
+void _fatextentrange(fat *f, int32_t node, int64_t lo, int64_t hi,
+		int32_t begin, int32_t end, struct fatextent *e) {
+	struct fatextent l, r;
+	int64_t mid, from, to;
+
+	if (begin <= lo && hi <= end) {
+		*e = f->extents[node];
+		return;
+	}
+
+	if (node >= f->extentsleaves) {
+		from = lo > begin ? lo : begin;
+		to = hi < end ? hi : end;
+		_fatextentleaf(e, f->freemap[lo / 64] >> (from - lo),
+			to - from + 1);
+		return;
+	}
+
+	mid = (lo + hi) / 2;
+	if (end <= mid)
+		_fatextentrange(f, 2 * node, lo, mid, begin, end, e);
+	else if (begin > mid)
+		_fatextentrange(f, 2 * node + 1, mid + 1, hi, begin, end, e);
+	else {
+		_fatextentrange(f, 2 * node, lo, mid, begin, end, &l);
+		_fatextentrange(f, 2 * node + 1, mid + 1, hi, begin, end, &r);
+		from = lo > begin ? lo : begin;
+		to = hi < end ? hi : end;
+		_fatextentjoin(e, &l, mid - from + 1, &r, to - mid);
+	}
+}
+
+int32_t _fatextentsequence(fat *f, int32_t begin, int32_t end, int length) {
+	int32_t run;
+
+	if (length == 1) {
+		run = _fatfreemapnext(f, begin, end, 1);
+		return run <= end ? run : FAT_ERR;
+	}
+
+	_fatextentsget(f);
+	run = 0;
+	return _fatextentfirst(f, 1, 0, 64 * (int64_t) f->extentsleaves - 1,
+		begin, end, length, &run);
+}
+
+int32_t _fatextentlongest(fat *f, int32_t begin, int32_t end,
+		int32_t *length) {
+	struct fatextent e;
+
+	_fatextentsget(f);
+	_fatextentrange(f, 1, 0, 64 * (int64_t) f->extentsleaves - 1,
+		begin, end, &e);
+	*length = e.longest;
+	return e.longest == 0 ? FAT_ERR :
+		_fatextentsequence(f, begin, end, e.longest);
+}
+
+/*
+ * access to the entries of each width: raw get and set of an entry, and get
+ * of a range of entries; the width is selected from the bits of the fat the
+ * first time it is needed, so that these functions do not check it
+ */
+
+int32_t _fatget12(fat *f, int nfat, int32_t n) {
+	int pcluster, phigh;
+	unit *fs, *fshigh;
+	uint32_t content;
+
+	fs = _fatclusterpos(f, nfat, n, n * 3LL / 2, &pcluster);
+	if (fs == NULL)
+		return FAT_ERR;
+
+	/* see above for an explanation */
+	fshigh = _fatclusterposnext(f, fs, pcluster, &phigh);
+	if (fshigh == NULL)
+		return FAT_ERR;
+	content = _unit8uint(fshigh, phigh) << 8;
+	content |= _unit8uint(fs, pcluster);
+	content = content >> ((n & 1) << 2);
+	return content & 0x0FFF;
+}
+
+int32_t _fatget16(fat *f, int nfat, int32_t n) {
+	int pcluster;
+	unit *fs;
+
+	fs = _fatclusterpos(f, nfat, n, n * 2LL, &pcluster);
+	if (fs == NULL)
+		return FAT_ERR;
+	return le16toh(_unit16uint(fs, pcluster));
+}
+
+int32_t _fatget32(fat *f, int nfat, int32_t n) {
+	int pcluster;
+	unit *fs;
+
+	fs = _fatclusterpos(f, nfat, n, n * 4LL, &pcluster);
+	if (fs == NULL)
+		return FAT_ERR;
+	return le32toh(_unit32uint(fs, pcluster)) & 0x0FFFFFFF;
+}
+
+int _fatset12(fat *f, int nfat, int32_t n, uint32_t next) {
+	int pcluster, phigh;
+	unit *fs, *fshigh;
+
+	fs = _fatclusterpos(f, nfat, n, n * 3LL / 2, &pcluster);
+	if (fs == NULL)
+		return -1;
+
+	/* see above for an explanation */
+	fshigh = _fatclusterposnext(f, fs, pcluster, &phigh);
+	if (fshigh == NULL)
+		return -1;
+	next = next << 4;
+	next |= _unit8uint(fs, pcluster) & 0x0F;
+	next |= (_unit8uint(fshigh, phigh) & 0xF0) << 12;
+	next = next >> ((~n & 1) << 2);
+	_unit8uint(fs, pcluster) = next & 0xFF;
+	_unit8uint(fshigh, phigh) = (next >> 8) & 0xFF;
+	fatunitdirty(fs, pcluster, 1);
+	fatunitdirty(fshigh, phigh, 1);
+	return 0;
+}
+
+int _fatset16(fat *f, int nfat, int32_t n, uint32_t next) {
+	int pcluster;
+	unit *fs;
+
+	fs = _fatclusterpos(f, nfat, n, n * 2LL, &pcluster);
+	if (fs == NULL)
+		return -1;
+	_unit16uint(fs, pcluster) = htole16(next);
+	fatunitdirty(fs, pcluster, 2);
+	return 0;
+}
+
+int _fatset32(fat *f, int nfat, int32_t n, uint32_t next) {
+	int pcluster;
+	unit *fs;
+
+	fs = _fatclusterpos(f, nfat, n, n * 4LL, &pcluster);
+	if (fs == NULL)
+		return -1;
+	_unit32uint(fs, pcluster) = htole32(next);
+	fatunitdirty(fs, pcluster, 4);
+	return 0;
+}
+
+/*
+ * entries from first to first + count - 1, decoded sector by sector; a fat12
+ * entry that straddles two sectors is taken by _fatget12()
+ */
+
+int _fatgetrange12(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos;
+	unit *fs;
+	unsigned char *data;
+	int32_t content;
+
+	while (count > 0) {
+		fs = _fatclusterpos(f, nfat, first, first * 3LL / 2, &pos);
+		if (fs == NULL)
+			return -1;
+		data = fatunitgetdata(fs);
+		for (; count > 0 && pos + 1 < fs->size; first++, count--) {
+			*entries++ = ((data[pos] | data[pos + 1] << 8) >>
+				((first & 1) << 2)) & 0x0FFF;
+			pos += 1 + (first & 1);
+		}
+		if (count > 0 && pos + 1 == fs->size) {
+			content = _fatget12(f, nfat, first);
+			if (content == FAT_ERR)
+				return -1;
+			*entries++ = content;
+			first++;
+			count--;
+		}
+	}
+	return 0;
+}
+
+int _fatgetrange16(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos, len, i;
+	unit *fs;
+	uint16_t *data;
+
+	for (; count > 0; first += len, count -= len, entries += len) {
+		fs = _fatclusterpos(f, nfat, first, first * 2LL, &pos);
+		if (fs == NULL)
+			return -1;
+		data = (uint16_t *) (fatunitgetdata(fs) + pos);
+		len = MIN(count, (fs->size - pos) / 2);
+		for (i = 0; i < len; i++)
+			entries[i] = le16toh(data[i]);
+	}
+	return 0;
+}
+
+int _fatgetrange32(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos, len, i;
+	unit *fs;
+	uint32_t *data;
+
+	for (; count > 0; first += len, count -= len, entries += len) {
+		fs = _fatclusterpos(f, nfat, first, first * 4LL, &pos);
+		if (fs == NULL)
+			return -1;
+		data = (uint32_t *) (fatunitgetdata(fs) + pos);
+		len = MIN(count, (fs->size - pos) / 4);
+		for (i = 0; i < len; i++)
+			entries[i] = le32toh(data[i]) & 0x0FFFFFFF;
+	}
+	return 0;
+}
+
+/*
+ * set entries from first to first + count - 1, sector by sector; only the
+ * bytes changed in each sector are marked dirty
+ */
+
+int _fatsetrange12(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos, begin;
+	unit *fs;
+	unsigned char *data;
+
+	while (count > 0) {
+		fs = _fatclusterpos(f, nfat, first, first * 3LL / 2, &pos);
+		if (fs == NULL)
+			return -1;
+		data = fatunitgetdata(fs);
+		begin = pos;
+		for (; count > 0 && pos + 1 < fs->size; first++, count--) {
+			if (first & 1) {
+				data[pos] = (data[pos] & 0x0F) |
+					((*entries << 4) & 0xF0);
+				data[pos + 1] = (*entries >> 4) & 0xFF;
+				pos += 2;
+			}
+			else {
+				data[pos] = *entries & 0xFF;
+				data[pos + 1] = (data[pos + 1] & 0xF0) |
+					((*entries >> 8) & 0x0F);
+				pos += 1;
+			}
+			entries++;
+		}
+		if (pos > begin)
+			fatunitdirty(fs, begin, MIN(pos + 1, fs->size) - begin);
+		if (count > 0 && pos + 1 == fs->size) {
+			if (_fatset12(f, nfat, first, *entries))
+				return -1;
+			entries++;
+			first++;
+			count--;
+		}
+	}
+	return 0;
+}
+
+int _fatsetrange16(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos, len, i;
+	unit *fs;
+	uint16_t *data;
+
+	for (; count > 0; first += len, count -= len, entries += len) {
+		fs = _fatclusterpos(f, nfat, first, first * 2LL, &pos);
+		if (fs == NULL)
+			return -1;
+		data = (uint16_t *) (fatunitgetdata(fs) + pos);
+		len = MIN(count, (fs->size - pos) / 2);
+		for (i = 0; i < len; i++)
+			data[i] = htole16(entries[i]);
+		fatunitdirty(fs, pos, len * 2);
+	}
+	return 0;
+}
+
+int _fatsetrange32(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries) {
+	int pos, len, i;
+	unit *fs;
+	uint32_t *data;
+
+	for (; count > 0; first += len, count -= len, entries += len) {
+		fs = _fatclusterpos(f, nfat, first, first * 4LL, &pos);
+		if (fs == NULL)
+			return -1;
+		data = (uint32_t *) (fatunitgetdata(fs) + pos);
+		len = MIN(count, (fs->size - pos) / 4);
+		for (i = 0; i < len; i++)
+			data[i] = htole32(entries[i]);
+		fatunitdirty(fs, pos, len * 4);
+	}
+	return 0;
+}
+
+const fatwidth fatwidth12 = {
+	12, 0x0FFF, -1,
+	_fatget12, _fatset12, _fatgetrange12, _fatsetrange12
+};
+
+const fatwidth fatwidth16 = {
+	16, 0xFFFF, 14,
+	_fatget16, _fatset16, _fatgetrange16, _fatsetrange16
+};
+
+const fatwidth fatwidth32 = {
+	32, 0x0FFFFFFF, 26,
+	_fatget32, _fatset32, _fatgetrange32, _fatsetrange32
+};
+
+const fatwidth *fatgetwidth(fat *f) {
+	if (f->width != NULL && f->width->bits == f->bits)
+		return f->width;
+
+	switch (fatbits(f)) {
+	case 12:
+		f->width = &fatwidth12;
+		break;
+	case 16:
+		f->width = &fatwidth16;
+		break;
+	case 32:
+		f->width = &fatwidth32;
+		break;
+	default:
+		f->width = NULL;
+	}
+	return f->width;
+}
+
+/*
+ * access the fat entry corresponding to a cluster (see note in table.h)
+ */
+
+int32_t fatgetfat(fat *f, int nfat, int32_t n) {
+	const fatwidth *w;
+
+	if (nfat == f->decodedfat && n >= 0 && n < f->decodedsize)
+		return f->decoded[n];
+	if (nfat == f->runsfat && n >= 0 && n < f->runssize)
+		return _fatrunentry(_fatrunat(f, _fatrunsfind(f, n)), n);
+
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return FAT_ERR;
+
+	if (nfat < 0 || nfat > fatgetnumfats(f)) {
+		printf("not an existing fat: %d\n", nfat);
+		exit(1);
+	}
+
+	return w->get(f, nfat, n);
+}
+
+int fatsetfat(fat *f, int nfat, int32_t n, int32_t next) {
+	const fatwidth *w;
+
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return -1;
+
+	if (nfat < 0 || nfat > fatgetnumfats(f)) {
+		printf("not an existing fat: %d\n", nfat);
+		exit(1);
+	}
+
+	if (w->set(f, nfat, n, next))
+		return -1;
+	f->changes++;
+
+	next &= w->mask;
+	if (nfat == f->decodedfat && n >= 0 && n < f->decodedsize)
+		f->decoded[n] = next;
+	if (nfat == f->runsfat && n >= 0 && n < f->runssize)
+		_fatrunsset(f, n, next);
+	_fatfreemapupdate(f, nfat, n, next == FAT_UNUSED);
+
+	return 0;
+}
+
+/*
+ * access a range of entries of a fat; like fatgetfat() and fatsetfat(), but
+ * the sectors are located once each instead of once per entry
+ */
+
+int fatgetfatrange(fat *f, int nfat, int32_t first, int32_t count,
+		int32_t *entries) {
+	const fatwidth *w;
+	int32_t r, i;
+
+	if (count <= 0)
+		return 0;
+
+	if (nfat == f->decodedfat &&
+	    first >= 0 && first + count <= f->decodedsize) {
+		memcpy(entries, f->decoded + first, count * sizeof(int32_t));
+		return 0;
+	}
+	if (nfat == f->runsfat &&
+	    first >= 0 && first + count <= f->runssize) {
+		r = _fatrunsfind(f, first);
+		for (i = 0; i < count; i++) {
+			if (first + i >= _fatrunat(f, r)->start +
+					_fatrunat(f, r)->length)
+				r++;
+			entries[i] = _fatrunentry(_fatrunat(f, r), first + i);
+		}
+		return 0;
+	}
+
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return -1;
+
+	if (nfat < 0 || nfat >= fatgetnumfats(f)) {
+		printf("not an existing fat: %d\n", nfat);
+		exit(1);
+	}
+	if (first < 0 || first + count > fatlastcluster(f) + 1)
+		return -1;
+
+	_fatreadentries(f, nfat, first, count);
+	return w->getrange(f, nfat, first, count, (uint32_t *) entries);
+}
+
+int fatsetfatrange(fat *f, int nfat, int32_t first, int32_t count,
+		int32_t *entries) {
+	const fatwidth *w;
+	int32_t i, next;
+
+	if (count <= 0)
+		return 0;
+
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return -1;
+
+	if (nfat < 0 || nfat >= fatgetnumfats(f)) {
+		printf("not an existing fat: %d\n", nfat);
+		exit(1);
+	}
+	if (first < 0 || first + count > fatlastcluster(f) + 1)
+		return -1;
+
+	_fatreadentries(f, nfat, first, count);
+	if (w->setrange(f, nfat, first, count, (uint32_t *) entries))
+		return -1;
+	f->changes++;
+
+	for (i = 0; i < count; i++) {
+		next = entries[i] & w->mask;
+		if (nfat == f->decodedfat && first + i < f->decodedsize)
+			f->decoded[first + i] = next;
+		if (nfat == f->runsfat && first + i < f->runssize)
+			_fatrunsset(f, first + i, next);
+		_fatfreemapupdate(f, nfat, first + i, next == FAT_UNUSED);
+	}
+
+	return 0;
 }
 
 /*
- * on fat12, two fat entries take three bytes; for example, if the first two
- * clusters have sucessors 2->ABC and 3->123, the beginning of the table is:
- *
- *    F8 FF FF   BC 3A 12
- * next of 2:    **  *
- * next of 3:       *  **
- *
- * each entry spans two bytes; the formulae take these two bytes in reverse
- * order, since this way the entries are easier to separate: BC 3A 12 becomes
- * 12 3A BC, which is 3A BC for the first entry and 12 3A for the second
+ * compare and merge the fats
  *
- * the second byte for an entry may fall in the next fat sector; for this
- * reason, the two bytes have to be read individually, rather than as a single
- * 16-bit integer
+ * the sectors of a chunk of entries are compared as bytes first, and decoded
+ * only if they differ somewhere; the merged entries of a chunk are written to
+ * each fat by a single fatsetfatrange()
  */
 
-/*
- * next byte for a fat12 entry: it may be in the next sector
- * nfat is not needed because the sector to possibly load is just fs->n + 1
- */
-
-unit *_fatclusterposnext(fat *f, unit *fs, int low, int *high) {
-	if (low != fatgetbytespersector(f) - 1) {
-		*high = low + 1;
-		return fs;
-	}
+#define COMPARE_CHUNK 4096
+
+int _fatsameentries(fat *f, int32_t first, int32_t count) {
+	int32_t from, to, s, size;
+	int nfat, bytes;
+	unit *u0, *u;
+
+	bytes = fatgetbytespersector(f);
+	size = fatgetfatsize(f);
+	from = ((int64_t) first) * fatbits(f) / 8 / bytes;
+	to = ((((int64_t) first) + count) * fatbits(f) / 8 + 1) / bytes;
+	if (to > size - 1)
+		to = size - 1;
+
+	for (nfat = 0; nfat < fatgetnumfats(f); nfat++)
+		_fatreadentries(f, nfat, first, count);
+
+	for (nfat = 1; nfat < fatgetnumfats(f); nfat++)
+		for (s = from; s <= to; s++) {
+			u0 = fatunitget(&f->sectors, f->offset, bytes,
+				fatgetreservedsectors(f) + s, f->fd);
+			u = fatunitget(&f->sectors, f->offset, bytes,
+				fatgetreservedsectors(f) + nfat * size + s,
+				f->fd);
+			if (u0 == NULL || u == NULL ||
+			    memcmp(fatunitgetdata(u0), fatunitgetdata(u), bytes))
+				return 0;
+		}
 
-	*high = 0;
-	return fatunitget(&f->sectors, f->offset, fatgetbytespersector(f),
-		fs->n + 1, f->fd);
+	return 1;
 }
 
 /*
- * access the fat entry corresponding to a cluster (see note in table.h)
+ * the value an entry should have given its values in all fats: the one in
+ * most of them, otherwise the only valid one, otherwise the one in the
+ * preferred fat; FAT_ERR if none of these exists
  */
-
-int32_t fatgetfat(fat *f, int nfat, int32_t n) {
-	int pcluster, phigh;
-	unit *fs, *fshigh;
-	uint32_t content;
-
-	if (fatbits(f) == -1)
-		return FAT_ERR;
-
-	if (nfat < 0 || nfat > fatgetnumfats(f)) {
-		printf("not an existing fat: %d\n", nfat);
-		exit(1);
+int32_t fatmergeentry(fat *f, int32_t *values, int preferred) {
+	int nfats, i, j, count;
+	int32_t valid;
+
+	nfats = fatgetnumfats(f);
+
+	for (i = 0; i < nfats; i++) {
+		for (j = 0, count = 0; j < nfats; j++)
+			if (values[j] == values[i])
+				count++;
+		if (count * 2 > nfats)
+			return values[i];
 	}
 
-	fs = _fatclusterpos(f, nfat, n, &pcluster);
-	if (fs == NULL)
-		return FAT_ERR;
-
-	switch (fatbits(f)) {
-	case 12:
-		/* see below for an explanation */
-		fshigh = _fatclusterposnext(f, fs, pcluster, &phigh);
-		if (fshigh == NULL)
-			return FAT_ERR;
-		content = _unit8uint(fshigh, phigh) << 8;
-		content |= _unit8uint(fs, pcluster);
-		content = content >> ((n & 1) << 2);
-		content = content & 0x0FFF;
-		return content;
-	case 16:
-		content = le16toh(_unit16int(fs, pcluster)) & 0xFFFF;
-		return content;
-	case 32:
-		content = le32toh(_unit32int(fs, pcluster)) & 0x0FFFFFFF;
-		return content;
+	valid = FAT_ERR;
+	for (i = 0; i < nfats; i++) {
+		if (values[i] > fatlastcluster(f))
+			continue;
+		if (valid != FAT_ERR && values[i] != valid)
+			break;
+		valid = values[i];
 	}
+	if (i == nfats && valid != FAT_ERR)
+		return valid;
+
+	if (preferred >= 0 && preferred < nfats)
+		return values[preferred];
 
 	return FAT_ERR;
 }
 
-int fatsetfat(fat *f, int nfat, int32_t n, int32_t next) {
-	int pcluster, phigh;
-	unit *fs, *fshigh;
-
-	if (fatbits(f) == -1)
+int _fatcomparefats(fat *f, int32_t begin, int32_t end, int preferred,
+		int merge,
+		void (*act)(fat *f, int32_t cluster, int32_t *values,
+			int32_t merged, void *user),
+		void *user) {
+	int nfats, nfat, i, changed;
+	int32_t first, count, lo, last, *entries, *values, *merged, *row;
+	int diff = 0;
+
+	nfats = fatgetnumfats(f);
+	if (begin < 0 || end > fatlastcluster(f) || nfats < 1)
+		return -1;
+	if (fatmirrorfats(f))
 		return -1;
 
-	if (nfat < 0 || nfat > fatgetnumfats(f)) {
-		printf("not an existing fat: %d\n", nfat);
+	entries = malloc(nfats * COMPARE_CHUNK * sizeof(int32_t));
+	values = malloc(nfats * sizeof(int32_t));
+	merged = malloc(COMPARE_CHUNK * sizeof(int32_t));
+	if (entries == NULL || values == NULL || merged == NULL) {
+		printf("cannot allocate memory\n");
 		exit(1);
 	}
 
-	fs = _fatclusterpos(f, nfat, n, &pcluster);
-	if (fs == NULL)
-		return -1;
+	for (first = begin; first <= end; first += count) {
+		count = MIN(COMPARE_CHUNK, end - first + 1);
+		if (_fatsameentries(f, first, count))
+			continue;
+		dprintf("fats differ in clusters %d - %d\n",
+			first, first + count - 1);
+
+		for (nfat = 0; nfat < nfats; nfat++)
+			if (fatgetfatrange(f, nfat, first, count,
+					entries + nfat * COMPARE_CHUNK)) {
+				diff = -1;
+				goto done;
+			}
 
-	switch (fatbits(f)) {
-	case 12:
-		/* see below for an explanation */
-		fshigh = _fatclusterposnext(f, fs, pcluster, &phigh);
-		next = next << 4;
-		next |= _unit8uint(fs, pcluster) & 0x0F;
-		next |= (_unit8uint(fshigh, phigh) & 0xF0) << 12;
-		next = next >> ((~n & 1) << 2);
-		_unit8uint(fs, pcluster) = next & 0xFF;
-		_unit8uint(fshigh, phigh) = (next >> 8) & 0xFF;
-		break;
-	case 16:
-		_unit16int(fs, pcluster) = htole16(next);
-		break;
-	case 32:
-		_unit32int(fs, pcluster) = htole32(next);
-		break;
+		changed = 0;
+		for (i = 0; i < count; i++) {
+			for (nfat = 0; nfat < nfats; nfat++)
+				values[nfat] = entries[nfat * COMPARE_CHUNK + i];
+			merged[i] = values[0];
+			for (nfat = 1; nfat < nfats; nfat++)
+				if (values[nfat] != values[0])
+					break;
+			if (nfat == nfats)
+				continue;
+			diff++;
+			merged[i] = fatmergeentry(f, values, preferred);
+			if (act != NULL)
+				act(f, first + i, values, merged[i], user);
+			if (merged[i] != FAT_ERR)
+				changed = 1;
+		}
+
+		if (! merge || ! changed)
+			continue;
+		for (nfat = 0; nfat < nfats; nfat++) {
+			row = entries + nfat * COMPARE_CHUNK;
+			lo = -1;
+			for (i = 0; i < count; i++)
+				if (merged[i] != FAT_ERR && merged[i] != row[i]) {
+					lo = lo == -1 ? i : lo;
+					last = i;
+					row[i] = merged[i];
+				}
+			if (lo != -1 && fatsetfatrange(f, nfat,
+					first + lo, last - lo + 1, row + lo)) {
+				diff = -1;
+				goto done;
+			}
+		}
 	}
 
-	fs->dirty = 1;
+done:
+	free(entries);
+	free(values);
+	free(merged);
+	return diff;
+}
 
-	return 0;
+int fatcomparefats(fat *f, int32_t begin, int32_t end, int preferred,
+		void (*act)(fat *f, int32_t cluster, int32_t *values,
+			int32_t merged, void *user),
+		void *user) {
+	return _fatcomparefats(f, begin, end, preferred, 0, act, user);
+}
+
+int fatmergefats(fat *f, int32_t begin, int32_t end, int preferred,
+		void (*act)(fat *f, int32_t cluster, int32_t *values,
+			int32_t merged, void *user),
+		void *user) {
+	return _fatcomparefats(f, begin, end, preferred, 1, act, user);
 }
 
 /*
  * fix the first two entries in a fat (the table "header")
  */
 int fatfixtableheader(fat *f, int nfat) {
-	switch (fatbits(f)) {
-	case 12:
-		if (fatsetfat(f, nfat, 0, fatgetmedia(f) | 0x0F00))
-			return -1;
-		return fatsetfat(f, nfat, 1, 0x0FF8);
-	case 16:
-		if (fatsetfat(f, nfat, 0, fatgetmedia(f) | 0xFF00))
-			return -1;
-		return fatsetfat(f, nfat, 1, 0xFFF8);
-	case 32:
-		if (fatsetfat(f, nfat, 0, fatgetmedia(f) | 0x0FFFFF00))
-			return -1;
-		return fatsetfat(f, nfat, 1, 0x0FFFFFF8);
-	}
+	const fatwidth *w;
 
-	return -1;
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return -1;
+
+	if (fatsetfat(f, nfat, 0, fatgetmedia(f) | (w->mask & ~0xFF)))
+		return -1;
+	return fatsetfat(f, nfat, 1, w->mask & ~0x07);
 }
 
 /*
@@ -243,14 +1486,10 @@ int fatfixtableheader(fat *f, int nfat) {
  */
 
 int _fatdirtybitsshift(fat *f) {
-	if (fatbits(f) == 12)
-		return -1;
-	else if (fatbits(f) == 16)
-		return 14;
-	else if (fatbits(f) == 32)
-		return 26;
-	else
-		return -1;
+	const fatwidth *w;
+
+	w = fatgetwidth(f);
+	return w == NULL ? -1 : w->dirtyshift;
 }
 
 int _swapdirtybits(int x) {
@@ -296,34 +1535,28 @@ int fatisfatunused(fat *f, int32_t n) {
 	return n == 0;
 }
 
+/* eof is 0x..FF8 to 0x..FFF, bad is 0x..FF7 */
+
 int fatisfateof(fat *f, int32_t n) {
-	uint32_t entry = (uint32_t) n;
-	switch (fatbits(f)) {
-	case 12:
-		return (entry & 0x0FF8) == 0x0FF8;
-	case 16:
-		return (entry & 0xFFF8) == 0xFFF8;
-	case 32:
-		return (entry & 0x0FFFFFF8) == 0x0FFFFFF8;
-	default:
+	const fatwidth *w;
+	uint32_t eof;
+
+	w = fatgetwidth(f);
+	if (w == NULL)
 		return 0;
-	}
+	eof = w->mask & ~0x07;
+	return (((uint32_t) n) & eof) == eof;
 }
 
 int fatisfatbad(fat *f, int32_t n) {
-	uint32_t entry = (uint32_t) n;
-	if (fatisfateof(f, n))
-		return 0;
-	switch (fatbits(f)) {
-	case 12:
-		return (entry & 0x0FF7) == 0x0FF7;
-	case 16:
-		return (entry & 0xFFF7) == 0xFFF7;
-	case 32:
-		return (entry & 0x0FFFFFF7) == 0x0FFFFFF7;
-	default:
+	const fatwidth *w;
+	uint32_t bad;
+
+	w = fatgetwidth(f);
+	if (w == NULL)
 		return 0;
-	}
+	bad = w->mask & ~0x08;
+	return (((uint32_t) n) & w->mask) == bad;
 }
 
 /*
@@ -389,11 +1622,55 @@ int32_t fatgetnextcluster(fat *f, int32_t n) {
 	return next;
 }
 
+/*
+ * the next of a range of clusters, in the same form as fatgetnextcluster();
+ * successors out of the filesystem are left to fatgetnextcluster() to report,
+ * and so are all entries if the range cannot be read at once; all entries are
+ * filled anyway, the return value is -1 if any of them is FAT_ERR
+ */
+
+int fatgetnextclusterrange(fat *f, int32_t first, int32_t count,
+		int32_t *next) {
+	const fatwidth *w;
+	int32_t i;
+	uint32_t eof, bad;
+	int res = 0;
+
+	if (count <= 0)
+		return 0;
+
+	w = fatgetwidth(f);
+	if (w == NULL || first < FAT_FIRST ||
+	    fatgetfatrange(f, f->nfat == FAT_ALL ? 0 : f->nfat,
+			first, count, next)) {
+		for (i = 0; i < count; i++)
+			if ((next[i] = fatgetnextcluster(f, first + i)) == FAT_ERR)
+				res = -1;
+		return res;
+	}
+
+	eof = w->mask & ~0x07;
+	bad = w->mask & ~0x08;
+	for (i = 0; i < count; i++) {
+		if (((uint32_t) next[i]) == bad)
+			next[i] = FAT_BAD;
+		else if ((((uint32_t) next[i]) & eof) == eof)
+			next[i] = FAT_EOF;
+		else if (next[i] > fatlastcluster(f) &&
+		         (next[i] = fatgetnextcluster(f, first + i)) == FAT_ERR)
+			res = -1;
+	}
+
+	return res;
+}
+
 /*
  * set the next of a cluster in a fat (FAT_ALL = all fats)
  */
 
 int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
+	const fatwidth *w;
+	int32_t prev;
 	int res;
 
 	if (n > fatlastcluster(f)) {
@@ -407,14 +1684,22 @@ int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
 		return -1;
 
 	if (f->free != -1 && f->nfat == FAT_ALL) {
-		if (fatgetnextcluster(f, n) != FAT_UNUSED &&
-				next == FAT_UNUSED)
+		prev = fatgetnextcluster(f, n);
+		if (prev != FAT_UNUSED && next == FAT_UNUSED)
 			f->free++;
-		if (fatgetnextcluster(f, n) == FAT_UNUSED &&
-				next != FAT_UNUSED)
+		if (prev == FAT_UNUSED && next != FAT_UNUSED)
 			f->free--;
 	}
 
+	if (f->nfat == FAT_ALL && f->mirror) {
+		f->nfat = 0;
+		res = fatsetnextcluster(f, n, next);
+		f->nfat = FAT_ALL;
+		if (res == 0)
+			_fatmirrormark(f, n);
+		return res;
+	}
+
 	if (f->nfat == FAT_ALL) {
 		res = 0;
 		for (f->nfat = 0; f->nfat < fatgetnumfats(f); f->nfat++)
@@ -429,16 +1714,10 @@ int fatsetnextcluster(fat *f, int32_t n, int32_t next) {
 	else if (next == FAT_BAD)
 		next = 0x0FFFFFF7;
 
-	switch (fatbits(f)) {
-	case 12:
-		return fatsetfat(f, f->nfat, n, next & 0x0FFF);
-	case 16:
-		return fatsetfat(f, f->nfat, n, next & 0xFFFF);
-	case 32:
-		return fatsetfat(f, f->nfat, n, next & 0x0FFFFFFF);
-	}
-
-	return -1;
+	w = fatgetwidth(f);
+	if (w == NULL)
+		return -1;
+	return fatsetfat(f, f->nfat, n, next & w->mask);
 }
 
 /*
@@ -478,6 +1757,14 @@ int fatinittable(fat *f, int nfat) {
 			fatunitwriteback(table);
 		}
 		fatunitdelete(&f->sectors, table->n);
+		f->changes++;
+		if (nfat == f->decodedfat)
+			for (cl = pilot; cl < f->decodedsize; cl++)
+				f->decoded[cl] = FAT_UNUSED;
+		if (nfat == f->runsfat)
+			_fatrunsclear(f, pilot);
+		if (nfat == f->freemapfat)
+			_fatfreemapdestroy(f);
 	}
 
 	r = fatgetrootbegin(f);
@@ -535,28 +1822,20 @@ int32_t fatclusterintervalnext(fat *f, int32_t c, int32_t begin, int32_t end) {
  */
 
 int32_t fatclusternumfreebetween(fat *f, int32_t begin, int32_t end) {
-	int32_t c, num;
+	int32_t num;
 
 	dprintf("counting free clusters between %d and %d\n", begin, end);
 
 	fatclusterisregular(f, begin);
 	fatclusterisregular(f, end);
 
-	dprintf("actual count is between %d and %d:", begin, end);
-
-	num = 0;
-	c = begin;
-	do {
-		dprintf(" %d", c);
-		if (fatgetnextcluster(f, c) == FAT_UNUSED) {
-			dprintf("*");
-			num++;
-		}
-
-		c = fatclusterintervalnext(f, c, begin, end);
-	} while (c != begin);
+	if (begin <= end)
+		num = _fatfreemapcount(f, begin, end);
+	else
+		num = _fatfreemapcount(f, begin, fatlastcluster(f)) +
+			_fatfreemapcount(f, FAT_FIRST, end);
 
-	dprintf("\n");
+	dprintf("free clusters: %d\n", num);
 	return num;
 }
 
@@ -569,10 +1848,40 @@ int32_t fatclusternumfree(fat *f) {
  * find free clusters (wrap if end < begin)
  */
 
+void _fatpart(int32_t part[2], int32_t begin, int32_t end) {
+	part[0] = begin;
+	part[1] = end;
+}
+
+/* clusters scanned at time through fatgetnextclusterrange() */
+#define RANGE_CHUNK 1024
+
+/*
+ * the interval from begin to end, starting at start and split where it wraps
+ */
+void _fatparts(fat *f, int32_t part[3][2],
+		int32_t begin, int32_t end, int32_t start) {
+	if (begin <= end) {
+		_fatpart(part[0], start, end);
+		_fatpart(part[1], begin, start - 1);
+		_fatpart(part[2], 1, 0);
+	}
+	else if (start >= begin) {
+		_fatpart(part[0], start, fatlastcluster(f));
+		_fatpart(part[1], FAT_FIRST, end);
+		_fatpart(part[2], begin, start - 1);
+	}
+	else {
+		_fatpart(part[0], start, end);
+		_fatpart(part[1], begin, fatlastcluster(f));
+		_fatpart(part[2], FAT_FIRST, start - 1);
+	}
+}
+
 int32_t fatclusterfindfreesequencebetween(fat *f,
 		int32_t begin, int32_t end, int32_t start, int length) {
-	int32_t cl, first;
-	int count;
+	int32_t part[3][2], first;
+	int i;
 
 	if (length <= 0)
 		return FAT_ERR;
@@ -591,27 +1900,21 @@ int32_t fatclusterfindfreesequencebetween(fat *f,
 
 	dprintf("actual search: %d - %d, start %d:", begin, end, start);
 
-	count = 0;
-	cl = start;
-	do {
-		dprintf(" %d", cl);
+	_fatparts(f, part, begin, end, start);
 
-		if (fatgetnextcluster(f, cl) != FAT_UNUSED)
-			count = 0;
-		else {
-			dprintf(" <-- found: %d (%d)\n", cl, count + 1);
-			if (count == 0)
-				first = cl;
-			count++;
-			if (cl < first)
-				count = 0;
-			f->last = cl;
-			if (count == length)
-				return first;
-		}
+			/* a sequence does not span two parts */
 
-		cl = fatclusterintervalnext(f, cl, begin, end);
-	} while (cl != start);
+	for (i = 0; i < 3; i++) {
+		if (part[i][0] > part[i][1])
+			continue;
+		dprintf(" %d-%d", part[i][0], part[i][1]);
+		first = _fatextentsequence(f, part[i][0], part[i][1], length);
+		if (first != FAT_ERR) {
+			dprintf(" <-- found: %d\n", first);
+			f->last = first + length - 1;
+			return first;
+		}
+	}
 
 	dprintf(" not found\n");
 	return FAT_ERR;
@@ -633,23 +1936,164 @@ int32_t fatclusterfindfree(fat *f) {
 }
 
 /*
- * presence and count of bad clusters in an area
+ * longest sequence of free clusters (wrap if end < begin)
  */
+int32_t fatclusterlongestfreebetween(fat *f,
+		int32_t begin, int32_t end, int32_t *length) {
+	int32_t first, second, len;
 
-int _fatclusterareabad(fat *f, int32_t begin, int32_t end, int st) {
-	int32_t cl;
-	int count = 0;
+	fatclusterisregular(f, begin);
+	fatclusterisregular(f, end);
 
-	cl = begin;
-	do {
-		if (fatgetnextcluster(f, cl) == FAT_BAD) {
-			if (st)
-				return -1;
-			count++;
+	if (begin <= end)
+		return _fatextentlongest(f, begin, end, length);
+
+	first = _fatextentlongest(f, begin, fatlastcluster(f), length);
+	second = _fatextentlongest(f, FAT_FIRST, end, &len);
+	if (len <= *length)
+		return first;
+	*length = len;
+	return second;
+}
+
+/*
+ * smallest sequence of at least length free clusters (wrap if end < begin)
+ */
+void _fatextentbest(fat *f, int32_t begin, int32_t end, int length,
+		int32_t *best, int32_t *min) {
+	int32_t cl, next;
+
+	for (cl = begin; cl <= end && *min != length; cl = next) {
+		cl = _fatextentsequence(f, cl, end, length);
+		if (cl == FAT_ERR)
+			break;
+		next = _fatfreemapnext(f, cl, end, 0);
+		if (*best == FAT_ERR || next - cl < *min) {
+			*best = cl;
+			*min = next - cl;
+		}
+	}
+}
+
+int32_t fatclusterfindbestfreesequencebetween(fat *f,
+		int32_t begin, int32_t end, int length) {
+	int32_t best, min;
+
+	if (length <= 0)
+		return FAT_ERR;
+
+	fatclusterisregular(f, begin);
+	fatclusterisregular(f, end);
+
+	best = FAT_ERR;
+	min = 0;
+	if (begin <= end)
+		_fatextentbest(f, begin, end, length, &best, &min);
+	else {
+		_fatextentbest(f, begin, fatlastcluster(f), length,
+			&best, &min);
+		_fatextentbest(f, FAT_FIRST, end, length, &best, &min);
+	}
+
+	dprintf("best free sequence of %d: %d, %d long\n", length, best, min);
+	if (best != FAT_ERR)
+		f->last = best + length - 1;
+	return best;
+}
+
+int32_t fatclusterfindbestfreesequence(fat *f, int length) {
+	return fatclusterfindbestfreesequencebetween(f,
+		FAT_FIRST, fatlastcluster(f), length);
+}
+
+/*
+ * allocation policy
+ */
+
+void fatsetallocation(fat *f, int policy, int32_t size,
+		int32_t begin, int32_t end) {
+	f->policy = policy;
+	f->allocsize = size < 1 ? 1 : size;
+	f->allocbegin = begin;
+	f->allocend = end;
+}
+
+int32_t fatclusterallocate(fat *f, int32_t previous) {
+	int32_t begin, end, start, cl, length;
+
+	begin = f->allocbegin == -1 ? FAT_FIRST : f->allocbegin;
+	end = f->allocend == -1 ? fatlastcluster(f) : f->allocend;
+
+			/* continue the chain in the next cluster if free */
+
+	if (f->policy != FAT_ALLOC_NEXT &&
+	    fatisvalidcluster(f, previous) && previous != end &&
+	    fatisvalidcluster(f, previous + 1) &&
+	    fatclusterisbetween(previous + 1, begin, end) &&
+	    fatgetnextcluster(f, previous + 1) == FAT_UNUSED) {
+		dprintf("allocate: %d follows %d\n", previous + 1, previous);
+		if (f->last < previous + 1)
+			f->last = previous + 1;
+		return previous + 1;
+	}
+
+	switch (f->policy) {
+	case FAT_ALLOC_BEST:
+		cl = fatclusterfindbestfreesequencebetween(f,
+			begin, end, f->allocsize);
+		if (cl != FAT_ERR)
+			return cl;
+		cl = fatclusterlongestfreebetween(f, begin, end, &length);
+		if (cl != FAT_ERR) {
+			f->last = cl + length - 1;
+			return cl;
 		}
+		break;
+	case FAT_ALLOC_NEAR:
+		start = fatisvalidcluster(f, previous) ? previous : f->allocnear;
+		if (fatisvalidcluster(f, start))
+			return fatclusterfindfreebetween(f, begin, end, start);
+		break;
+	case FAT_ALLOC_RESERVE:
+		if (fatisvalidcluster(f, previous))
+			break;
+		start = f->last + f->allocsize;
+		if (! fatisvalidcluster(f, start) ||
+		    ! fatclusterisbetween(start, begin, end))
+			start = begin;
+		cl = fatclusterfindfreesequencebetween(f,
+			begin, end, start, f->allocsize);
+		if (cl != FAT_ERR) {
+			f->last = cl;
+			return cl;
+		}
+		break;
+	}
+
+	return fatclusterfindfreebetween(f, begin, end, -1);
+}
 
-		cl = fatclusterintervalnext(f, cl, begin, end);
-	} while (cl != begin);
+/*
+ * presence and count of bad clusters in an area
+ */
+
+int _fatclusterareabad(fat *f, int32_t begin, int32_t end, int st) {
+	int32_t part[3][2], next[RANGE_CHUNK], cl, len, i;
+	int p, count = 0;
+
+	_fatparts(f, part, begin, end, begin);
+
+	for (p = 0; p < 3; p++)
+		for (cl = part[p][0]; cl <= part[p][1]; cl += len) {
+			len = MIN(RANGE_CHUNK, part[p][1] - cl + 1);
+			fatgetnextclusterrange(f, cl, len, next);
+			for (i = 0; i < len; i++)
+				if (next[i] == FAT_BAD) {
+					if (st)
+						return -1;
+					count++;
+				}
+		}
 
 	return count;
 }
@@ -682,6 +2126,15 @@ int32_t fatclustermostfree(fat *f, int size, int allowbad,
 	*maxfree = 0;
 	max = FAT_ERR;
 
+			/* an area that is all free, if any, is the first one */
+
+	start = _fatextentsequence(f, FAT_FIRST, fatlastcluster(f), size);
+	if (start != FAT_ERR) {
+		*maxfree = size;
+		return start;
+	}
+	start = FAT_FIRST;
+
 	numfree = fatclusternumfreebetween(f, start, start + size - 1);
 	numbad = fatclusternumbadbetween(f, start, start + size - 1);
 
@@ -764,7 +2217,8 @@ int32_t fatclusterlongestlinear(fat *f, int32_t start,
  */
 int fatclusterfindallocatedbetween(fat *f,
 		int32_t begin, int32_t end, int32_t start) {
-	int32_t c;
+	int32_t part[3][2], next[RANGE_CHUNK], cl, len, i;
+	int p;
 
 	dprintf("searching for a used clusters between %d and %d\n",
 		begin, end);
@@ -777,19 +2231,20 @@ int fatclusterfindallocatedbetween(fat *f,
 
 	dprintf("actual search is between %d and %d:", begin, end);
 
-	c = start;
-	do {
-		dprintf(" %d", c);
-
-		if (fatgetnextcluster(f, c) != FAT_UNUSED &&
-				fatgetnextcluster(f, c) != FAT_BAD) {
-			dprintf("\n");
-			return c;
+	_fatparts(f, part, begin, end, start);
+
+	for (p = 0; p < 3; p++)
+		for (cl = part[p][0]; cl <= part[p][1]; cl += len) {
+			dprintf(" %d", cl);
+			len = MIN(RANGE_CHUNK, part[p][1] - cl + 1);
+			fatgetnextclusterrange(f, cl, len, next);
+			for (i = 0; i < len; i++)
+				if (next[i] != FAT_UNUSED && next[i] != FAT_BAD) {
+					dprintf(" <-- found: %d\n", cl + i);
+					return cl + i;
+				}
 		}
 
-		c = fatclusterintervalnext(f, c, begin, end);
-	} while (c != start);
-
 	dprintf("\n");
 	return FAT_ERR;
 }
@@ -815,6 +2270,141 @@ int fatclusterfreechain(fat *f, int32_t begin) {
 	return 0;
 }
 
+/*
+ * maps of the chains last looked up: the runs of consecutive clusters of each
+ * chain with their position in it, built only as far as needed; a map is
+ * thrown away when any fat entry changes after it was built
+ */
+
+#define CHAIN_MAPS 8
+
+struct fatchainrun {
+	int32_t index;
+	int32_t cluster;
+	int32_t length;
+};
+
+struct fatchainmap {
+	int32_t first;
+	int nfat;
+	uint32_t changes;
+	int32_t length;			/* clusters mapped */
+	int ended;			/* the whole chain is mapped */
+	int32_t end;			/* next of its last cluster */
+	struct fatchainrun *runs;
+	int32_t nruns, maxruns;
+	uint64_t used;
+};
+
+struct fatchainmap *_fatchainmap(fat *f, int32_t first) {
+	struct fatchainmap *m, *old;
+	int i;
+
+	if (f->chainmaps == NULL) {
+		f->chainmaps = calloc(CHAIN_MAPS, sizeof(struct fatchainmap));
+		if (f->chainmaps == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+
+	old = f->chainmaps;
+	for (i = 0; i < CHAIN_MAPS; i++) {
+		m = f->chainmaps + i;
+		if (m->runs != NULL && m->first == first &&
+		    m->nfat == f->nfat && m->changes == f->changes) {
+			m->used = ++f->chainused;
+			return m;
+		}
+		if (m->used < old->used)
+			old = m;
+	}
+
+	dprintf("new map of chain %d\n", first);
+	old->first = first;
+	old->nfat = f->nfat;
+	old->changes = f->changes;
+	old->length = 0;
+	old->ended = 0;
+	old->nruns = 0;
+	if (old->runs == NULL) {
+		old->maxruns = 16;
+		old->runs = malloc(old->maxruns * sizeof(struct fatchainrun));
+		if (old->runs == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+	old->used = ++f->chainused;
+	return old;
+}
+
+int32_t fatchaincluster(fat *f, int32_t first, int32_t index) {
+	struct fatchainmap *m;
+	struct fatchainrun *r;
+	int32_t low, high, mid, next;
+
+	if (first < FAT_FIRST || first > fatlastcluster(f) || index < 0)
+		return FAT_ERR;
+
+	m = _fatchainmap(f, first);
+
+	while (m->length <= index) {
+		if (m->ended)
+			return m->end;
+		r = m->runs + m->nruns - 1;
+		next = m->nruns == 0 ?
+			first : fatgetnextcluster(f, r->cluster + r->length - 1);
+		if (next < FAT_FIRST || m->length > fatlastcluster(f)) {
+			m->ended = 1;
+			m->end = next < FAT_FIRST ? next : FAT_ERR;
+			return m->end;
+		}
+
+		if (m->nruns > 0 && next == r->cluster + r->length) {
+			r->length++;
+			m->length++;
+			continue;
+		}
+		if (m->nruns == m->maxruns) {
+			m->maxruns *= 2;
+			m->runs = realloc(m->runs,
+				m->maxruns * sizeof(struct fatchainrun));
+			if (m->runs == NULL) {
+				printf("cannot allocate memory\n");
+				exit(1);
+			}
+		}
+		r = m->runs + m->nruns++;
+		r->index = m->length;
+		r->cluster = next;
+		r->length = 1;
+		m->length++;
+	}
+
+	low = 0;
+	high = m->nruns - 1;
+	while (low < high) {
+		mid = (low + high + 1) / 2;
+		if (m->runs[mid].index <= index)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return m->runs[low].cluster + index - m->runs[low].index;
+}
+
+void fatchainfree(fat *f) {
+	int i;
+
+	if (f->chainmaps == NULL)
+		return;
+	for (i = 0; i < CHAIN_MAPS; i++)
+		free(f->chainmaps[i].runs);
+	free(f->chainmaps);
+	f->chainmaps = NULL;
+}
+
 /*
  * origin and size of a cluster
  */
@@ -848,31 +2438,56 @@ int fatclusterposition(fat *f, int32_t cl, uint64_t *origin, int *size) {
 
 /*
  * read and create a cluster; writeback is by fatunitwriteback(unit *)
+ *
+ * a created cluster is not read from the filesystem: if not already in cache
+ * it is zeroed and dirty, since the caller is going to overwrite it; data can
+ * also be written straight to a cluster without caching it
  */
 
 unit *fatclustercreate(fat *f, int32_t cl) {
 	uint64_t origin;
 	int size;
-	unit *cluster;
 
 	fatclusterposition(f, cl, &origin, &size);
 	dprintf("origin: %" PRId64 ", size: %d\n", origin, size);
 
-	cluster = fatunitget(&f->clusters, f->offset + origin, size, cl,
+	return fatunitgetblank(&f->clusters, f->offset + origin, size, cl,
 			f->fd);
-	if (cluster != NULL)
-		return cluster;
+}
+
+int fatclusterwritedirect(fat *f, int32_t cl, unsigned char *data, int len) {
+	uint64_t origin;
+	int size;
+
+	fatclusterposition(f, cl, &origin, &size);
+	if (len > size)
+		return -1;
+
+	return fatunitwritedirect(f->clusters, f->offset + origin, size, cl,
+			f->fd, data, len);
+}
 
-	cluster = fatunitcreate(size);
-	if (cluster == NULL)
-		return NULL;
-	cluster->n = cl;
-	cluster->origin = f->offset + origin;
-	if (fatunitinsert(&f->clusters, cluster, 0)) {
-		fatunitdestroy(cluster);
-		return NULL;
+/*
+ * when reading a cluster that is not cached, also read the clusters that
+ * follow it in its chain, as long as they are consecutive and not cached, up
+ * to f->readahead bytes; a single read is more efficient than many
+ */
+void _fatclusterreadahead(fat *f, int32_t cl, uint64_t origin, int size) {
+	int32_t next;
+	int count, max;
+
+	max = f->readahead / size;
+	for (count = 1; count < max; count++) {
+		next = fatgetnextcluster(f, cl + count - 1);
+		if (next != cl + count ||
+		    ! fatisvalidcluster(f, next) ||
+		    fatunitcached(f->clusters, next))
+			break;
 	}
-	return cluster;
+
+	if (count > 1)
+		fatunitgetrun(&f->clusters, f->offset + origin, size, cl,
+			count, f->fd);
 }
 
 unit *fatclusterread(fat *f, int32_t cl) {
@@ -881,6 +2496,9 @@ unit *fatclusterread(fat *f, int32_t cl) {
 
 	fatclusterposition(f, cl, &origin, &size);
 	dprintf("origin: %" PRId64 ", size: %d\n", origin, size);
+	if (f->readahead > size && cl >= FAT_FIRST &&
+	    fatisvalidcluster(f, cl) && ! fatunitcached(f->clusters, cl))
+		_fatclusterreadahead(f, cl, origin, size);
 	return fatunitget(&f->clusters, f->offset + origin, size, cl, f->fd);
 }
 
@@ -39,6 +39,21 @@
  */
 int fatreadfat(fat *f, int nfat);
 
+/*
+ * decode a whole FAT in an array of entries, so that fatgetfat() on it does
+ * not access the sectors; fatsetfat() updates both; only one FAT at time
+ */
+int fatdecodefat(fat *f, int nfat);
+void fatdecodefree(fat *f);
+
+/*
+ * same, but the entries are stored as runs of consecutive clusters, which
+ * takes much less memory when the files are not fragmented; lookups are
+ * logarithmic in the number of runs
+ */
+int fatcompressfat(fat *f, int nfat);
+void fatcompressfree(fat *f);
+
 /* specific values for a cluster number */
 #define FAT_FIRST (2)
 #define FAT_ROOT (1)
@@ -59,6 +74,59 @@ int fatreadfat(fat *f, int nfat);
 int32_t fatgetfat(fat *f, int nfat, int32_t n);
 int fatsetfat(fat *f, int nfat, int32_t n, int32_t next);
 
+/*
+ * access count fat entries from first, locating each sector only once
+ */
+int fatgetfatrange(fat *f, int nfat, int32_t first, int32_t count,
+		int32_t *entries);
+int fatsetfatrange(fat *f, int nfat, int32_t first, int32_t count,
+		int32_t *entries);
+
+/*
+ * compare the entries of all fats from begin to end, calling act on each
+ * cluster where they differ with the values in all fats and the merged value
+ * (see fatmergeentry); fatmergefats() also writes the merged value to all fats
+ * when it is not FAT_ERR; return the number of differences, or -1 on error
+ */
+int32_t fatmergeentry(fat *f, int32_t *values, int preferred);
+int fatcomparefats(fat *f, int32_t begin, int32_t end, int preferred,
+		void (*act)(fat *f, int32_t cluster, int32_t *values,
+			int32_t merged, void *user),
+		void *user);
+int fatmergefats(fat *f, int32_t begin, int32_t end, int preferred,
+		void (*act)(fat *f, int32_t cluster, int32_t *values,
+			int32_t merged, void *user),
+		void *user);
+
+/*
+ * the functions for accessing the entries of a FAT of a given width; the
+ * getrange function decodes count entries from first in a single scan of the
+ * sectors and setrange sets them the same way; fatgetwidth() returns the one
+ * for the filesystem, chosen once
+ */
+typedef struct fatwidth {
+	int bits;
+	uint32_t mask;
+	int dirtyshift;
+	int32_t (*get)(fat *f, int nfat, int32_t n);
+	int (*set)(fat *f, int nfat, int32_t n, uint32_t next);
+	int (*getrange)(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries);
+	int (*setrange)(fat *f, int nfat, int32_t first, int32_t count,
+		uint32_t *entries);
+} fatwidth;
+
+extern const fatwidth fatwidth12, fatwidth16, fatwidth32;
+const fatwidth *fatgetwidth(fat *f);
+
+/*
+ * deferred mirroring: when enabled, fatsetnextcluster() with f->nfat == FAT_ALL
+ * changes only the first fat, and the bytes changed are copied to the others
+ * by fatmirrorfats(); this is called by fatflush() and when disabling it
+ */
+void fatsetmirror(fat *f, int mirror);
+int fatmirrorfats(fat *f);
+
 /*
  * set the first two entries in a fat (the table "header")
  */
@@ -85,6 +153,8 @@ void fatprintfat(fat *f, int32_t n);
  */
 int32_t fatgetnextcluster(fat *f, int32_t cluster);
 int fatsetnextcluster(fat *f, int32_t cluster, int32_t next);
+int fatgetnextclusterrange(fat *f, int32_t first, int32_t count,
+		int32_t *next);
 
 /*
  * initialize a file allocation table
@@ -118,6 +188,41 @@ int32_t fatclusterfindfreebetween(fat *f,
 		int32_t begin, int32_t end, int32_t start);
 int32_t fatclusterfindfree(fat *f);
 
+/*
+ * longest sequence of free clusters; smallest sequence of at least length
+ * free clusters (best fit); wrap if end < begin
+ */
+int32_t fatclusterlongestfreebetween(fat *f,
+		int32_t begin, int32_t end, int32_t *length);
+int32_t fatclusterfindbestfreesequencebetween(fat *f,
+		int32_t begin, int32_t end, int length);
+int32_t fatclusterfindbestfreesequence(fat *f, int length);
+
+/*
+ * allocation policy: how fatclusterallocate() chooses the free cluster that
+ * follows previous in a chain, or the first of a new chain if previous is not
+ * a cluster; all but FAT_ALLOC_NEXT first try the cluster after previous
+ *
+ * FAT_ALLOC_NEXT	next fit: the first free cluster from the last found
+ * FAT_ALLOC_BEST	the smallest sequence of at least size free clusters,
+ *			or the longest if none is that long
+ * FAT_ALLOC_NEAR	the first free cluster after previous, or after
+ *			f->allocnear (the directory) for a new chain
+ * FAT_ALLOC_RESERVE	a new chain starts at a sequence of size free
+ *			clusters, after size clusters left for the previous
+ *			chain to grow into
+ *
+ * begin and end restrict the clusters allocated; -1 is the whole fat; the
+ * cluster is not marked as used
+ */
+#define FAT_ALLOC_NEXT    0
+#define FAT_ALLOC_BEST    1
+#define FAT_ALLOC_NEAR    2
+#define FAT_ALLOC_RESERVE 3
+void fatsetallocation(fat *f, int policy, int32_t size,
+		int32_t begin, int32_t end);
+int32_t fatclusterallocate(fat *f, int32_t previous);
+
 /*
  * presence and count of bad clusters in an area
  */
@@ -151,12 +256,22 @@ int fatclusterfindallocated(fat *f, int32_t begin, int32_t end);
  */
 int fatclusterfreechain(fat *f, int32_t begin);
 
+/*
+ * the cluster at a position in the chain from first, counting from zero; if
+ * the chain is shorter, what follows its last cluster (FAT_EOF, FAT_UNUSED,
+ * FAT_BAD or FAT_ERR); the chain is followed once, even if called for several
+ * positions, until a fat entry changes; fatchainfree() releases the maps
+ */
+int32_t fatchaincluster(fat *f, int32_t first, int32_t index);
+void fatchainfree(fat *f);
+
 /*
  * create and read a cluster; writeback is done by fatunitwriteback(unit *)
  */
 int fatclusterposition(fat *f, int32_t cl, uint64_t *origin, int *size);
 unit *fatclustercreate(fat *f, int32_t cl);
 unit *fatclusterread(fat *f, int32_t cl);
+int fatclusterwritedirect(fat *f, int32_t cl, unsigned char *data, int len);
 
 /*
  * the cluster that contains a sector
@@ -425,3 +425,140 @@ int utf8casecmp(const char* a, const char* b)
 {
     return utf8ncasecmp(a, b, SIZE_MAX);
 }
+
+uint32_t utf8hash(const char* s)
+{
+    // fnv-1a of the bytes
+    uint32_t h = 2166136261u;
+    for (; *s; ++s) {
+        h = (h ^ (uint8_t)*s) * 16777619u;
+    }
+    return h;
+}
+
+// lowercase eight ascii characters at a time: the bytes between 'A' and 'Z'
+// get 0x20 added; they are all below 0x80, so no sum carries over the next
+static uint64_t asciifold8(uint64_t w)
+{
+    uint64_t geA = w + 0x3f3f3f3f3f3f3f3full;
+    uint64_t gtZ = w + 0x2525252525252525ull;
+    return w | ((geA & ~gtZ & 0x8080808080808080ull) >> 2);
+}
+
+static size_t utf8encode(utf8proc_int32_t c, uint8_t* buf)
+{
+    if (c < 0x80) {
+        buf[0] = c;
+        return 1;
+    } else if (c < 0x800) {
+        buf[0] = 0xC0 | (c >> 6);
+        buf[1] = 0x80 | (c & 0x3F);
+        return 2;
+    } else if (c < 0x10000) {
+        buf[0] = 0xE0 | (c >> 12);
+        buf[1] = 0x80 | ((c >> 6) & 0x3F);
+        buf[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    buf[0] = 0xF0 | (c >> 18);
+    buf[1] = 0x80 | ((c >> 12) & 0x3F);
+    buf[2] = 0x80 | ((c >> 6) & 0x3F);
+    buf[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+size_t utf8casefold(char* dst, size_t size, const char* src)
+{
+    const uint8_t* s = (const uint8_t*)src;
+    const uint8_t* end = s + strlen(src);
+    utf8proc_int32_t c;
+    utf8proc_ssize_t r, rf, idx;
+    utf8proc_int32_t cf[10];
+    uint8_t buf[4 * 10];
+    size_t o = 0, n;
+    uint64_t w;
+
+    while (s < end) {
+        // ascii fast path
+        if (end - s >= 8 && o + 8 < size) {
+            memcpy(&w, s, 8);
+            if (!(w & 0x8080808080808080ull)) {
+                w = asciifold8(w);
+                memcpy(dst + o, &w, 8);
+                s += 8;
+                o += 8;
+                continue;
+            }
+        }
+
+        r = utf8proc_iterate(s, end - s, &c);
+        rf = r < 0 ? -1 : utf8proc_decompose_char(c, cf, 10, UTF8PROC_CASEFOLD, NULL);
+        if (rf < 0 || rf > 10) {
+            // not valid or not folded: copy as is
+            n = r < 0 ? 1 : r;
+            memcpy(buf, s, n);
+        } else {
+            for (n = 0, idx = 0; idx < rf; ++idx) {
+                n += utf8encode(cf[idx], buf + n);
+            }
+        }
+        if (o + n < size) {
+            memcpy(dst + o, buf, n);
+        }
+        o += n;
+        s += r < 0 ? 1 : r;
+    }
+
+    if (o < size) {
+        dst[o] = '\0';
+    }
+    return o;
+}
+
+int utf8foldedcmp(const char* key, const char* s)
+{
+    const uint8_t* k = (const uint8_t*)key;
+    const uint8_t* kend = k + strlen(key);
+    const uint8_t* p = (const uint8_t*)s;
+    const uint8_t* end = p + strlen(s);
+    utf8proc_int32_t c;
+    utf8proc_ssize_t r, rf, idx;
+    utf8proc_int32_t cf[10];
+    uint8_t buf[4 * 10];
+    size_t n;
+    uint64_t w, v;
+
+    while (p < end) {
+        // ascii fast path
+        if (end - p >= 8 && kend - k >= 8) {
+            memcpy(&w, p, 8);
+            if (!(w & 0x8080808080808080ull)) {
+                memcpy(&v, k, 8);
+                if (asciifold8(w) != v) {
+                    return 1;
+                }
+                p += 8;
+                k += 8;
+                continue;
+            }
+        }
+
+        r = utf8proc_iterate(p, end - p, &c);
+        rf = r < 0 ? -1 : utf8proc_decompose_char(c, cf, 10, UTF8PROC_CASEFOLD, NULL);
+        if (rf < 0 || rf > 10) {
+            n = r < 0 ? 1 : r;
+            memcpy(buf, p, n);
+        } else {
+            for (n = 0, idx = 0; idx < rf; ++idx) {
+                n += utf8encode(cf[idx], buf + n);
+            }
+        }
+        if ((size_t)(kend - k) < n || memcmp(k, buf, n)) {
+            return 1;
+        }
+        k += n;
+        p += r < 0 ? 1 : r;
+    }
+
+    return k == kend ? 0 : 1;
+}
@@ -39,4 +39,14 @@ int utf8ncmp(const char* a, const char* b, size_t n);
 int utf8casecmp(const char* a, const char* b);
 int utf8ncasecmp(const char* a, const char* b, size_t n);
 
+// hash of the bytes of a string
+uint32_t utf8hash(const char* s);
+
+// case fold a string into dst, of size bytes; return the length of the
+// result, which is complete only if less than size
+size_t utf8casefold(char* dst, size_t size, const char* src);
+
+// compare a string with a case folded one: zero if the string folds to it
+int utf8foldedcmp(const char* key, const char* s);
+
 #endif // UC2CONV_H__
@@ -26,51 +26,210 @@
 #include <errno.h>
 #include <string.h>
 #include <stdint.h>
-#include <search.h>
 #include <ctype.h>
+#include <limits.h>
+#include <time.h>
 #include "unit.h"
-#ifdef __APPLE__
-# include "linux_tsearch.h"
-#else
-# include <search.h>
-#endif
 
 int fatunitdebug = 0;
 #define dprintf if (fatunitdebug) printf
 
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
-
-#define UNUSED_DEPTH int __attribute__((unused)) depth
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
 #define NO_ORIGIN ((uint64_t) -1)
 
 /*
- * create, copy and deallocate a unit
+ * slabs
+ *
+ * a slab allocates blocks of the same size from large chunks; a freed block
+ * goes in a list of free blocks of its size, and is reused by the next
+ * allocation; the chunks are only released when the slab is destroyed, all
+ * together; the first bytes of a free block point to the next free block, the
+ * first bytes of a chunk to the next chunk
+ *
+ * blocks of SLAB_SECTOR bytes or more are aligned to SLAB_SECTOR and their
+ * size is a multiple of it, as required for direct i/o
  */
 
-unit *fatunitcreate(int size) {
-	unit *u;
+#define SLAB_CHUNK (256 * 1024)
+#define SLAB_ALIGN 16
+#define SLAB_SECTOR 512
+
+int _fatunitslabalign(int size) {
+	return size >= SLAB_SECTOR ? SLAB_SECTOR : SLAB_ALIGN;
+}
+
+unitslab *fatunitslabcreate() {
+	unitslab *slab;
 
-	u = malloc(sizeof(unit));
-	if (u == NULL) {
+	slab = malloc(sizeof(unitslab));
+	if (slab == NULL) {
 		printf("cannot allocate memory\n");
 		exit(1);
 	}
+	slab->classes = NULL;
+	slab->nclasses = 0;
+	slab->size = 0;
+	slab->units = 0;
+	slab->destroyed = 0;
+	return slab;
+}
 
-	u->size = size;
-	u->origin = NO_ORIGIN;
-	u->data = malloc(size);
+/*
+ * the units detached from a cache may still be alive: the chunks are released
+ * when the last of them is destroyed
+ */
+void fatunitslabdestroy(unitslab *slab) {
+	int i;
+	void *chunk, *next;
+
+	if (slab == NULL)
+		return;
+	if (slab->units > 0) {
+		dprintf("slab with %d units left\n", slab->units);
+		slab->destroyed = 1;
+		return;
+	}
+	for (i = 0; i < slab->nclasses; i++)
+		for (chunk = slab->classes[i].chunks; chunk; chunk = next) {
+			next = * (void **) chunk;
+			free(chunk);
+		}
+	free(slab->classes);
+	free(slab);
+}
+
+unitslabclass *_fatunitslabclass(unitslab *slab, int size) {
+	int i, align;
+	unitslabclass *c;
+
+	align = _fatunitslabalign(size);
+	size = (size + align - 1) / align * align;
+	for (i = 0; i < slab->nclasses; i++)
+		if (slab->classes[i].size == size)
+			return &slab->classes[i];
+
+	slab->classes = realloc(slab->classes,
+		(slab->nclasses + 1) * sizeof(unitslabclass));
+	if (slab->classes == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	c = &slab->classes[slab->nclasses++];
+	c->size = size;
+	c->free = NULL;
+	c->chunks = NULL;
+	return c;
+}
+
+void *_fatunitslaballoc(unitslab *slab, int size) {
+	unitslabclass *c;
+	unsigned char *chunk, *block;
+	int n, i, align;
+	void *b;
+
+	c = _fatunitslabclass(slab, size);
+
+	if (c->free == NULL) {
+		n = MAX(1, SLAB_CHUNK / c->size);
+		align = _fatunitslabalign(c->size);
+		if (posix_memalign(&b, align, align + (size_t) n * c->size)) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		chunk = b;
+		dprintf("slab chunk of %d blocks of %d bytes\n", n, c->size);
+		* (void **) chunk = c->chunks;
+		c->chunks = chunk;
+		slab->size += align + (uint64_t) n * c->size;
+		for (i = n - 1; i >= 0; i--) {
+			block = chunk + align + (size_t) i * c->size;
+			* (void **) block = c->free;
+			c->free = block;
+		}
+	}
+
+	b = c->free;
+	c->free = * (void **) b;
+	return b;
+}
+
+void _fatunitslabfree(unitslab *slab, void *block, int size) {
+	unitslabclass *c;
+
+	if (block == NULL)
+		return;
+	c = _fatunitslabclass(slab, size);
+	* (void **) block = c->free;
+	c->free = block;
+}
+
+/*
+ * allocate and free the data of a unit, from its slab if any
+ */
+
+void _fatunitdataalloc(unit *u) {
+	if (u->slab != NULL) {
+		u->data = _fatunitslaballoc(u->slab, u->size);
+		return;
+	}
+	u->data = malloc(u->size);
 	if (u->data == NULL) {
 		printf("cannot allocate memory\n");
 		exit(1);
 	}
+}
+
+void _fatunitdatafree(unit *u) {
+	if (u->slab != NULL)
+		_fatunitslabfree(u->slab, u->data, u->size);
+	else
+		free(u->data);
+	u->data = NULL;
+}
+
+/*
+ * create, copy and deallocate a unit
+ */
+
+unit *_fatunitcreate(unitslab *slab, int size) {
+	unit *u;
+
+	if (slab != NULL) {
+		u = _fatunitslaballoc(slab, sizeof(unit));
+		slab->units++;
+	}
+	else {
+		u = malloc(sizeof(unit));
+		if (u == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+	}
+
+	u->slab = slab;
+	u->size = size;
+	u->origin = NO_ORIGIN;
+	_fatunitdataalloc(u);
 	u->refer = 0;
 	u->dirty = 0;
 	u->user = NULL;
+	u->pool = NULL;
+	u->newer = NULL;
+	u->older = NULL;
+	u->hot = 0;
+	u->prefetched = 0;
+	u->io = &fatunitpio;
+	u->stats = NULL;
 
 	return u;
 }
 
+unit *fatunitcreate(int size) {
+	return _fatunitcreate(NULL, size);
+}
+
 unit *fatunitcopy(unit *u) {
 	unit *c;
 
@@ -83,24 +242,40 @@ unit *fatunitcopy(unit *u) {
 		exit(1);
 	}
 	memcpy(c, u, sizeof(unit));
+	c->slab = NULL;
+	c->stats = NULL;
+	c->pool = NULL;
+	c->newer = NULL;
+	c->older = NULL;
+	c->hot = 0;
+	c->prefetched = 0;
 	if (u->data) {
-		c->data = malloc(u->size);
-		if (c->data == NULL) {
-			printf("cannot allocate memory\n");
-			exit(1);
-		}
+		_fatunitdataalloc(c);
 		memcpy(c->data, u->data, u->size);
 	}
 
 	return c;
 }
 
+void _fatunitpoolunlink(unit *u);
+
 void fatunitdestroy(unit *u) {
-	dprintf("deleting unit %d\n", u->n);
+	unitslab *slab;
+
 	if (u == NULL)
 		return;
-	free(u->data);
-	free(u);
+	dprintf("deleting unit %d\n", u->n);
+	_fatunitpoolunlink(u);
+	_fatunitdatafree(u);
+	slab = u->slab;
+	if (slab == NULL) {
+		free(u);
+		return;
+	}
+	_fatunitslabfree(slab, u, sizeof(unit));
+	slab->units--;
+	if (slab->destroyed && slab->units == 0)
+		fatunitslabdestroy(slab);
 }
 
 /*
@@ -230,26 +405,230 @@ int fatsimulateread(char *filename, int fd) {
 	return 0;
 }
 
+/*
+ * the default i/o backend: pread() and pwrite(), so that the position of fd is
+ * neither used nor changed
+ */
+
+ssize_t _fatpioreadat(unitio *io, int fd,
+		void *buf, size_t len, uint64_t pos) {
+	(void) io;
+	return pread(fd, buf, len, pos);
+}
+
+ssize_t _fatpiowriteat(unitio *io, int fd,
+		const void *buf, size_t len, uint64_t pos) {
+	(void) io;
+	return pwrite(fd, buf, len, pos);
+}
+
+ssize_t _fatpioreadv(unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos) {
+	(void) io;
+	return preadv(fd, iov, iovcnt, pos);
+}
+
+ssize_t _fatpiowritev(unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos) {
+	(void) io;
+	return pwritev(fd, iov, iovcnt, pos);
+}
+
+int _fatpioflush(unitio *io, int fd) {
+	(void) io;
+	return fsync(fd);
+}
+
+int _fatpiodiscard(unitio *io, int fd, uint64_t pos, uint64_t len) {
+	(void) io;
+#ifdef FALLOC_FL_PUNCH_HOLE
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		pos, len);
+#else
+	(void) fd;
+	(void) pos;
+	(void) len;
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+unitio fatunitpio = {
+	_fatpioreadat,
+	_fatpiowriteat,
+	_fatpioreadv,
+	_fatpiowritev,
+	_fatpioflush,
+	_fatpiodiscard,
+	NULL
+};
+
+/*
+ * the direct i/o backend: fd is opened with O_DIRECT, which requires buffers,
+ * positions and lengths to be aligned to the sector size of the device; the
+ * units from a slab are, but not the ones made by fatunitcreate() or the root
+ * directory of a fat12/fat16 that is not a whole number of sectors; these
+ * transfers, and the ones the device rejects because its sectors are larger,
+ * are done with O_DIRECT temporarily disabled
+ */
+
+#define DIRECT_ALIGN 512
+
+int _fatdirectset(int fd, int direct) {
+#ifdef O_DIRECT
+	int flags, saved;
+
+	saved = errno;
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return -1;
+	flags = direct ? flags | O_DIRECT : flags & ~O_DIRECT;
+	if (fcntl(fd, F_SETFL, flags) == -1)
+		return -1;
+	errno = saved;
+	return 0;
+#else
+	(void) fd;
+	return direct ? -1 : 0;
+#endif
+}
+
+int _fatdirectaligned(const void *buf, size_t len, uint64_t pos) {
+	return (uintptr_t) buf % DIRECT_ALIGN == 0 &&
+		len % DIRECT_ALIGN == 0 &&
+		pos % DIRECT_ALIGN == 0;
+}
+
+int _fatdirectalignedv(const struct iovec *iov, int iovcnt, uint64_t pos) {
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if (! _fatdirectaligned(iov[i].iov_base, iov[i].iov_len, pos))
+			return 0;
+	return 1;
+}
+
+ssize_t _fatdirectreadat(unitio *io, int fd,
+		void *buf, size_t len, uint64_t pos) {
+	ssize_t res;
+
+	if (_fatdirectaligned(buf, len, pos)) {
+		res = pread(fd, buf, len, pos);
+		if (res != -1 || errno != EINVAL)
+			return res;
+	}
+	_fatdirectset(fd, 0);
+	res = _fatpioreadat(io, fd, buf, len, pos);
+	_fatdirectset(fd, 1);
+	return res;
+}
+
+ssize_t _fatdirectwriteat(unitio *io, int fd,
+		const void *buf, size_t len, uint64_t pos) {
+	ssize_t res;
+
+	if (_fatdirectaligned(buf, len, pos)) {
+		res = pwrite(fd, buf, len, pos);
+		if (res != -1 || errno != EINVAL)
+			return res;
+	}
+	_fatdirectset(fd, 0);
+	res = _fatpiowriteat(io, fd, buf, len, pos);
+	_fatdirectset(fd, 1);
+	return res;
+}
+
+ssize_t _fatdirectreadv(unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos) {
+	ssize_t res;
+
+	if (_fatdirectalignedv(iov, iovcnt, pos)) {
+		res = preadv(fd, iov, iovcnt, pos);
+		if (res != -1 || errno != EINVAL)
+			return res;
+	}
+	_fatdirectset(fd, 0);
+	res = _fatpioreadv(io, fd, iov, iovcnt, pos);
+	_fatdirectset(fd, 1);
+	return res;
+}
+
+ssize_t _fatdirectwritev(unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos) {
+	ssize_t res;
+
+	if (_fatdirectalignedv(iov, iovcnt, pos)) {
+		res = pwritev(fd, iov, iovcnt, pos);
+		if (res != -1 || errno != EINVAL)
+			return res;
+	}
+	_fatdirectset(fd, 0);
+	res = _fatpiowritev(io, fd, iov, iovcnt, pos);
+	_fatdirectset(fd, 1);
+	return res;
+}
+
+unitio fatunitdirectio = {
+	_fatdirectreadat,
+	_fatdirectwriteat,
+	_fatdirectreadv,
+	_fatdirectwritev,
+	_fatpioflush,
+	_fatpiodiscard,
+	NULL
+};
+
+/*
+ * count the calls to the i/o backend in the statistics of a cache
+ */
+
+uint64_t _fatunitclock() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((uint64_t) t.tv_sec) * 1000000000 + t.tv_nsec;
+}
+
+void _fatunitcountread(unitstats *stats,
+		int vectored, ssize_t res, uint64_t start) {
+	if (stats == NULL)
+		return;
+	if (vectored)
+		stats->readvs++;
+	else
+		stats->reads++;
+	if (res > 0)
+		stats->readbytes += res;
+	stats->readtime += _fatunitclock() - start;
+}
+
+void _fatunitcountwrite(unitstats *stats,
+		int vectored, ssize_t res, uint64_t start) {
+	if (stats == NULL)
+		return;
+	if (vectored)
+		stats->writevs++;
+	else
+		stats->writes++;
+	if (res > 0)
+		stats->writebytes += res;
+	stats->writetime += _fatunitclock() - start;
+}
+
 /*
  * read and write a unit from the filesystem
  */
 
-int _fatunitseek(unit *u) {
-	off_t res, pos;
+uint64_t _fatunitposition(unit *u) {
+	return u->origin + ((uint64_t) u->n) * u->size;
+}
 
-	pos = u->origin + ((uint64_t) u->n) * u->size;
-	dprintf("lseek %" PRIu64 "\n", pos);
+int _fatunitpos(unit *u, uint64_t *pos) {
+	*pos = _fatunitposition(u);
+	dprintf("position %" PRIu64 "\n", *pos);
 
-	res = lseek(u->fd, pos, SEEK_SET);
 	SIMULATE_ERROR(FAT_SEEK, u);
-	if (res == (off_t) -1) {
-		if (u->origin == NO_ORIGIN)
-			printf("unspecified origin of unit %d\n", u->n);
-		else {
-			printf("error in lseek to unit %d, ", u->n);
-			printf("position %" PRId64 ", ", pos);
-			printf("description: %s\n", strerror(errno));
-		}
+	if (u->origin == NO_ORIGIN) {
+		printf("unspecified origin of unit %d\n", u->n);
 		u->error |= FAT_SEEK;
 		return -1;
 	}
@@ -258,19 +637,22 @@ int _fatunitseek(unit *u) {
 }
 
 int _fatunitread(unit *u) {
-	off_t res;
+	uint64_t pos, start;
+	ssize_t res;
 	dprintf("reading unit %d, origin %" PRId64 "\n", u->n, u->origin);
 
-	if (_fatunitseek(u))
+	if (_fatunitpos(u, &pos))
 		return -1;
 
-	res = read(u->fd, u->data, u->size);
+	start = _fatunitclock();
+	res = u->io->readat(u->io, u->fd, u->data, u->size, pos);
+	_fatunitcountread(u->stats, 0, res, start);
 	SIMULATE_ERROR(FAT_READ, u);
 	if (res != u->size) {
 		if (res == -1)
 			printf("error in read: %s\n", strerror(errno));
 		else
-			printf("short read: %" PRId64 " < %d\n", res, u->size);
+			printf("short read: %zd < %d\n", res, u->size);
 		u->error |= FAT_READ;
 		return -1;
 	}
@@ -278,20 +660,60 @@ int _fatunitread(unit *u) {
 	return 0;
 }
 
+/*
+ * partial dirtiness: a unit where only some bytes changed is written back
+ * only in the sectors that contain them
+ */
+void fatunitdirty(unit *u, int offset, int len) {
+	if (u->dirty == UNIT_DIRTY)
+		return;
+	if (u->dirty != UNIT_PARTIAL) {
+		u->dirtybegin = offset;
+		u->dirtyend = offset + len;
+	}
+	else {
+		u->dirtybegin = MIN(u->dirtybegin, offset);
+		u->dirtyend = MAX(u->dirtyend, offset + len);
+	}
+	u->dirty = UNIT_PARTIAL;
+}
+
+void _fatunitdirtyrange(unit *u, int *begin, int *end) {
+	if (u->dirty != UNIT_PARTIAL) {
+		*begin = 0;
+		*end = u->size;
+		return;
+	}
+	*begin = u->dirtybegin / UNIT_DIRTYSECTOR * UNIT_DIRTYSECTOR;
+	*end = (u->dirtyend + UNIT_DIRTYSECTOR - 1) /
+		UNIT_DIRTYSECTOR * UNIT_DIRTYSECTOR;
+	*begin = MAX(*begin, 0);
+	*end = MIN(*end, u->size);
+}
+
 int _fatunitwrite(unit *u) {
-	off_t res;
+	uint64_t pos, start;
+	ssize_t res;
+	int begin, end;
 	dprintf("writing unit %d, origin %" PRId64 "\n", u->n, u->origin);
 
-	if (_fatunitseek(u))
+	if (_fatunitpos(u, &pos))
 		return -1;
 
-	res = write(u->fd, u->data, u->size);
+	_fatunitdirtyrange(u, &begin, &end);
+	if (begin != 0 || end != u->size)
+		dprintf("writing bytes %d-%d\n", begin, end);
+
+	start = _fatunitclock();
+	res = u->io->writeat(u->io, u->fd,
+		u->data + begin, end - begin, pos + begin);
+	_fatunitcountwrite(u->stats, 0, res, start);
 	SIMULATE_ERROR(FAT_WRITE, u);
-	if (res != u->size) {
+	if (res != end - begin) {
 		if (res == -1)
 			printf("error in write: %s\n", strerror(errno));
 		else
-			printf("short write: %" PRId64 " < %d\n", res, u->size);
+			printf("short write: %zd < %d\n", res, end - begin);
 		u->error |= FAT_WRITE;
 		return -1;
 	}
@@ -300,59 +722,576 @@ int _fatunitwrite(unit *u) {
 }
 
 /*
- * order of units in the tree
+ * memory pools
+ *
+ * a unit is linked in the lists of a pool if it is in a cache that has a pool
+ * (u->pool != NULL) and its data is allocated (u->data != NULL); the lists are
+ * ordered from the most recently used to the least recently used unit
+ */
+
+#define POOL_KEEP 8
+
+unitpool *fatunitpoolcreate(uint64_t max, int policy) {
+	unitpool *pool;
+
+	pool = malloc(sizeof(unitpool));
+	if (pool == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	pool->max = max;
+	pool->size = 0;
+	pool->policy = policy;
+	pool->newest[0] = pool->newest[1] = NULL;
+	pool->oldest[0] = pool->oldest[1] = NULL;
+	pool->count[0] = pool->count[1] = 0;
+	pool->hotsize = 0;
+	return pool;
+}
+
+/*
+ * the units are not destroyed: deallocate the caches first
+ */
+void fatunitpooldestroy(unitpool *pool) {
+	free(pool);
+}
+
+void _fatunitpoolinsert(unit *u, int hot) {
+	unitpool *pool = u->pool;
+
+	u->hot = hot;
+	u->older = pool->newest[hot];
+	u->newer = NULL;
+	if (pool->newest[hot] != NULL)
+		pool->newest[hot]->newer = u;
+	else
+		pool->oldest[hot] = u;
+	pool->newest[hot] = u;
+	pool->count[hot]++;
+	if (hot)
+		pool->hotsize += u->size;
+}
+
+void _fatunitpoolremove(unit *u) {
+	unitpool *pool = u->pool;
+
+	if (u->newer != NULL)
+		u->newer->older = u->older;
+	else
+		pool->newest[u->hot] = u->older;
+	if (u->older != NULL)
+		u->older->newer = u->newer;
+	else
+		pool->oldest[u->hot] = u->newer;
+	pool->count[u->hot]--;
+	if (u->hot)
+		pool->hotsize -= u->size;
+	u->newer = NULL;
+	u->older = NULL;
+	u->hot = 0;
+}
+
+void _fatunitpoollink(unit *u) {
+	if (u->pool == NULL || u->data == NULL)
+		return;
+	_fatunitpoolinsert(u, 0);
+	u->pool->size += u->size;
+}
+
+void _fatunitpoolunlink(unit *u) {
+	u->prefetched = 0;
+	if (u->pool == NULL || u->data == NULL)
+		return;
+	_fatunitpoolremove(u);
+	u->pool->size -= u->size;
+}
+
+/*
+ * a unit is used again: make it the most recent; with UNIT_SLRU, it moves to
+ * the protected list, which is kept within three quarters of the pool by
+ * moving its oldest units back to probation; the first use of a unit read
+ * ahead is its first, not a second: it only becomes the newest in probation
+ */
+void _fatunitpooltouch(unit *u) {
+	unitpool *pool = u->pool;
+	unit *o;
+
+	if (pool == NULL || u->data == NULL)
+		return;
+
+	if (u->prefetched) {
+		u->prefetched = 0;
+		if (pool->newest[u->hot] != u) {
+			_fatunitpoolremove(u);
+			_fatunitpoolinsert(u, 0);
+		}
+		return;
+	}
+
+	if (pool->newest[u->hot] == u)
+		return;
+
+	_fatunitpoolremove(u);
+	if (pool->policy != UNIT_SLRU) {
+		_fatunitpoolinsert(u, 0);
+		return;
+	}
+
+	_fatunitpoolinsert(u, 1);
+	while (pool->max != 0 && pool->hotsize > pool->max / 4 * 3 &&
+	       pool->oldest[1] != u) {
+		o = pool->oldest[1];
+		_fatunitpoolremove(o);
+		_fatunitpoolinsert(o, 0);
+	}
+}
+
+/*
+ * free the data of the least recently used units until the pool is within its
+ * limit; the most recent units of each list are never evicted, since the
+ * caller may still be using them without having marked them dirty yet
+ */
+void _fatunitpoolshrink(unitpool *pool) {
+	unit *u, *next;
+	int hot;
+	int32_t scan;
+
+	if (pool == NULL || pool->max == 0)
+		return;
+
+	for (hot = 0; hot <= 1 && pool->size > pool->max; hot++) {
+		scan = pool->count[hot] - POOL_KEEP;
+		for (u = pool->oldest[hot];
+		     u != NULL && scan > 0 && pool->size > pool->max;
+		     u = next, scan--) {
+			next = u->newer;
+			if (u->refer > 0)
+				continue;
+			if (fatunitwriteback(u))
+				continue;
+			dprintf("evicting unit %d\n", u->n);
+			if (u->stats != NULL)
+				u->stats->evictions++;
+			fatunitfree(u);
+		}
+	}
+}
+
+/*
+ * the cache: a hash table with linear probing, indexed by unit number
+ *
+ * the table is kept at most half full, so that runs of occupied slots are
+ * short; removing a unit shifts back the following ones in its run, so that
+ * no "deleted" marker is needed and lookups stop at the first empty slot
+ */
+
+#define CACHE_MINBITS 6
+
+uint32_t _fatunithash(unitcache *cache, int32_t n) {
+	return ((uint32_t) n * 2654435769U) >> (32 - cache->bits);
+}
+
+unitcache *_fatunitcachecreate(int bits) {
+	unitcache *cache;
+
+	cache = malloc(sizeof(unitcache));
+	if (cache == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	cache->bits = bits;
+	cache->count = 0;
+	cache->pool = NULL;
+	cache->io = NULL;
+	cache->slab = NULL;
+	memset(&cache->stats, 0, sizeof(unitstats));
+	cache->table = calloc(1 << bits, sizeof(unit *));
+	if (cache->table == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	return cache;
+}
+
+/*
+ * the slot of unit n, or the empty slot where it would go
+ */
+unit **_fatunitslot(unitcache *cache, int32_t n) {
+	uint32_t i, mask;
+
+	mask = (1U << cache->bits) - 1;
+	for (i = _fatunithash(cache, n);
+	     cache->table[i] != NULL;
+	     i = (i + 1) & mask)
+		if (cache->table[i]->n == n)
+			break;
+	return &cache->table[i];
+}
+
+unit **_fatunitfind(unitcache *cache, int32_t n) {
+	unit **s;
+
+	if (cache == NULL)
+		return NULL;
+	s = _fatunitslot(cache, n);
+	return *s == NULL ? NULL : s;
+}
+
+void _fatunitcachegrow(unitcache *cache) {
+	unit **old;
+	int32_t i, size;
+
+	old = cache->table;
+	size = 1 << cache->bits;
+
+	cache->bits++;
+	cache->table = calloc(1 << cache->bits, sizeof(unit *));
+	if (cache->table == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < size; i++)
+		if (old[i] != NULL)
+			*_fatunitslot(cache, old[i]->n) = old[i];
+	free(old);
+}
+
+/*
+ * insert a unit not already in cache
+ */
+void _fatunitcacheadd(unitcache **cache, unit *u) {
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+	if (2 * ((*cache)->count + 1) > (1 << (*cache)->bits))
+		_fatunitcachegrow(*cache);
+
+	*_fatunitslot(*cache, u->n) = u;
+	(*cache)->count++;
+
+	u->pool = (*cache)->pool;
+	_fatunitpoollink(u);
+	if ((*cache)->io != NULL)
+		u->io = (*cache)->io;
+	u->stats = &(*cache)->stats;
+}
+
+/*
+ * remove the unit in a slot, shifting back the following ones in its run
+ */
+void _fatunitcacheremove(unitcache *cache, unit **slot) {
+	uint32_t i, j, k, mask;
+
+	_fatunitpoolunlink(*slot);
+	(*slot)->pool = NULL;
+	(*slot)->stats = NULL;
+
+	mask = (1U << cache->bits) - 1;
+	i = slot - cache->table;
+	cache->table[i] = NULL;
+	cache->count--;
+
+	for (j = (i + 1) & mask; cache->table[j] != NULL; j = (j + 1) & mask) {
+		k = _fatunithash(cache, cache->table[j]->n);
+		if (i <= j ? i < k && k <= j : i < k || k <= j)
+			continue;
+		cache->table[i] = cache->table[j];
+		cache->table[j] = NULL;
+		i = j;
+	}
+}
+
+/*
+ * order of units, for walking the cache
  */
 
 int _compareunit(const void *a, const void *b) {
-	if (((unit *) a)->n < ((unit *) b)->n)
+	if ((* (unit **) a)->n < (* (unit **) b)->n)
 		return -1;
-	else if (((unit *) a)->n == ((unit *) b)->n)
+	else if ((* (unit **) a)->n == (* (unit **) b)->n)
 		return 0;
 	else
 		return 1;
 }
 
+/*
+ * use a pool for a cache; the units already in the cache are moved to it
+ */
+void fatunitsetpool(unitcache **cache, unitpool *pool) {
+	int32_t i;
+	unit *u;
+
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+
+	for (i = 0; i < 1 << (*cache)->bits; i++) {
+		u = (*cache)->table[i];
+		if (u == NULL)
+			continue;
+		_fatunitpoolunlink(u);
+		u->pool = pool;
+		_fatunitpoollink(u);
+	}
+	(*cache)->pool = pool;
+
+	_fatunitpoolshrink(pool);
+}
+
+/*
+ * use an i/o backend for the units of a cache, including those already there
+ */
+void fatunitsetio(unitcache **cache, unitio *io) {
+	int32_t i;
+
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+
+	for (i = 0; i < 1 << (*cache)->bits; i++)
+		if ((*cache)->table[i] != NULL)
+			(*cache)->table[i]->io = io;
+	(*cache)->io = io;
+}
+
+/*
+ * allocate the units that a cache reads from a slab; the units already in the
+ * cache are not changed
+ */
+void fatunitsetslab(unitcache **cache, unitslab *slab) {
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+	(*cache)->slab = slab;
+}
+
 /*
  * get, insert, move, swap, writeback and delete a unit from the cache
  */
 
-unit *fatunitget(unit **cache, uint64_t origin, int size, long n, int fd) {
-	unit k, **s, *i, *r;
+unit *fatunitget(unitcache **cache,
+		uint64_t origin, int size, long n, int fd) {
+	unit **s, *i;
 
-	k.n = n;
-	s = (unit **) tfind(&k, (void **) cache, _compareunit);
-	if (s != NULL && (*s)->data != NULL)
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+
+	s = _fatunitfind(*cache, n);
+	if (s != NULL && (*s)->data != NULL) {
+		(*cache)->stats.hits++;
+		_fatunitpooltouch(*s);
 		return *s;
+	}
+	(*cache)->stats.misses++;
 
 	if (s == NULL)
-		i = fatunitcreate(size);
+		i = _fatunitcreate((*cache)->slab, size);
 	else {
 		i = *s;
 		i->size = size;
-		i->data = malloc(size);
-		if (i->data == NULL) {
-			printf("cannot allocate memory\n");
-			exit(1);
-		}
+		_fatunitdataalloc(i);
 	}
 	i->origin = origin;
 	i->n = n;
 	i->fd = fd;
+	if ((*cache)->io != NULL)
+		i->io = (*cache)->io;
+	i->stats = &(*cache)->stats;
 
-	if (_fatunitread(i))
+	if (_fatunitread(i)) {
+		if (s == NULL)
+			fatunitdestroy(i);
+		else
+			_fatunitdatafree(i);
 		return NULL;
-	r = * (unit **) tsearch(i, (void **) cache, _compareunit);
-	if (r == NULL) {
-		printf("insufficient memory to store cluster %d ", i->n);
-		printf("in cache\n");
 	}
-	return r;
+	if (s == NULL)
+		_fatunitcacheadd(cache, i);
+	else
+		_fatunitpoollink(i);
+	_fatunitpoolshrink(i->pool);
+	return i;
+}
+
+/*
+ * get a unit that is going to be overwritten, without reading it; if it is
+ * not in cache it is created zeroed and dirty
+ */
+unit *fatunitgetblank(unitcache **cache,
+		uint64_t origin, int size, long n, int fd) {
+	unit **s, *i;
+
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+
+	s = _fatunitfind(*cache, n);
+	if (s != NULL && (*s)->data != NULL) {
+		(*cache)->stats.hits++;
+		_fatunitpooltouch(*s);
+		return *s;
+	}
+	(*cache)->stats.misses++;
+
+	if (s == NULL)
+		i = _fatunitcreate((*cache)->slab, size);
+	else {
+		i = *s;
+		i->size = size;
+		_fatunitdataalloc(i);
+	}
+	i->origin = origin;
+	i->n = n;
+	i->fd = fd;
+	memset(i->data, 0, size);
+	i->dirty = 1;
+
+	if (s == NULL)
+		_fatunitcacheadd(cache, i);
+	else
+		_fatunitpoollink(i);
+	_fatunitpoolshrink(i->pool);
+	return i;
+}
+
+/*
+ * write len bytes at the start of unit n straight to the filesystem, without
+ * caching them; if the unit is in cache, it is updated and written back
+ * instead, so that the cache does not go stale
+ */
+int fatunitwritedirect(unitcache *cache, uint64_t origin, int size, long n,
+		int fd, unsigned char *data, int len) {
+	unit **s;
+	unitio *io;
+	uint64_t pos, start;
+	ssize_t res;
+
+	s = _fatunitfind(cache, n);
+	if (s != NULL && (*s)->data != NULL) {
+		memcpy((*s)->data, data, len);
+		fatunitdirty(*s, 0, len);
+		return fatunitwriteback(*s);
+	}
+
+	if (origin == NO_ORIGIN) {
+		printf("unspecified origin of unit %ld\n", n);
+		return -1;
+	}
+	pos = origin + ((uint64_t) n) * size;
+	io = cache != NULL && cache->io != NULL ? cache->io : &fatunitpio;
+	dprintf("writing %d bytes of unit %ld directly\n", len, n);
+
+	start = _fatunitclock();
+	res = io->writeat(io, fd, data, len, pos);
+	_fatunitcountwrite(cache == NULL ? NULL : &cache->stats, 0, res, start);
+	if (res != len) {
+		if (res == -1)
+			printf("error in write: %s\n", strerror(errno));
+		else
+			printf("short write: %zd < %d\n", res, len);
+		return -1;
+	}
+	return 0;
 }
 
-int fatunitinsert(unit **cache, unit *u, int replace) {
+/*
+ * read count consecutive units starting from n by a single vectored read and
+ * put them in the cache as clean units; the ones already in the cache with
+ * their data are not replaced, but are still read from the filesystem, so a
+ * caller should stop the run at the first of them; the units are linked in
+ * the pool in reverse order, so that n is the most recently used, and marked
+ * prefetched, so that their first use does not count as a second one
+ */
+int fatunitgetrun(unitcache **cache,
+		uint64_t origin, int size, long n, int count, int fd) {
+	unit **run, **s;
+	struct iovec *iov;
+	unitio *io;
+	unitslab *slab;
+	uint64_t start;
+	ssize_t res;
+	int i;
+
+	if (count <= 1 || origin == NO_ORIGIN || fat_simulate_errors != NULL)
+		return 0;
+	count = MIN(count, IOV_MAX);
+
+	if (*cache == NULL)
+		*cache = _fatunitcachecreate(CACHE_MINBITS);
+	io = (*cache)->io != NULL ? (*cache)->io : &fatunitpio;
+	slab = (*cache)->slab;
+
+	run = malloc(count * sizeof(unit *));
+	iov = malloc(count * sizeof(struct iovec));
+	if (run == NULL || iov == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	for (i = 0; i < count; i++) {
+		run[i] = _fatunitcreate(slab, size);
+		run[i]->origin = origin;
+		run[i]->n = n + i;
+		run[i]->fd = fd;
+		run[i]->io = io;
+		iov[i].iov_base = run[i]->data;
+		iov[i].iov_len = size;
+	}
+
+	dprintf("reading units %ld-%ld, origin %" PRId64 "\n",
+		n, n + count - 1, origin);
+	start = _fatunitclock();
+	res = io->readv(io, fd, iov, count, _fatunitposition(run[0]));
+	_fatunitcountread(&(*cache)->stats, 1, res, start);
+	if (res != (ssize_t) count * size) {
+		dprintf("vectored read failed\n");
+		for (i = 0; i < count; i++)
+			fatunitdestroy(run[i]);
+		count = -1;
+	}
+	else
+		for (i = count - 1; i >= 0; i--) {
+			s = _fatunitfind(*cache, n + i);
+			if (s == NULL) {
+				_fatunitcacheadd(cache, run[i]);
+				run[i]->prefetched = 1;
+			}
+			else if ((*s)->data != NULL)
+				fatunitdestroy(run[i]);
+			else {
+				(*s)->size = size;
+				(*s)->origin = origin;
+				_fatunitdataalloc(*s);
+				memcpy((*s)->data, run[i]->data, size);
+				(*s)->dirty = 0;
+				fatunitdestroy(run[i]);
+				_fatunitpoollink(*s);
+				(*s)->prefetched = 1;
+			}
+		}
+
+	free(iov);
+	free(run);
+	_fatunitpoolshrink((*cache)->pool);
+	return count;
+}
+
+/*
+ * whether a unit is in the cache with its data, so that fatunitget() does not
+ * read it
+ */
+int fatunitcached(unitcache *cache, long n) {
+	unit **s;
+
+	s = _fatunitfind(cache, n);
+	return s != NULL && (*s)->data != NULL;
+}
+
+int fatunitinsert(unitcache **cache, unit *u, int replace) {
 	unit **f;
 
-	f = (unit **) tsearch(u, (void **) cache, _compareunit);
+	f = _fatunitfind(*cache, u->n);
+	if (f == NULL) {
+		u->dirty = 1;
+		_fatunitcacheadd(cache, u);
+		_fatunitpoolshrink(u->pool);
+		return 0;
+	}
 	if (*f == u) {
 		u->dirty = 1;
 		return 0;
@@ -363,16 +1302,21 @@ int fatunitinsert(unit **cache, unit *u, int replace) {
 	fatunitdestroy(*f);
 	*f = u;
 	u->dirty = 1;
+	u->pool = (*cache)->pool;
+	_fatunitpoollink(u);
+	if ((*cache)->io != NULL)
+		u->io = (*cache)->io;
+	_fatunitpoolshrink(u->pool);
 	return 0;
 }
 
-void fatunitmove(unit **cache, unit *u, int dest) {
+void fatunitmove(unitcache **cache, unit *u, int dest) {
 	fatunitdetach(cache, u->n);
 	u->n = dest;
 	fatunitinsert(cache, u, 1);
 }
 
-void fatunitswap(unit **cache, unit *u, unit *w) {
+void fatunitswap(unitcache **cache, unit *u, unit *w) {
 	int32_t un, wn;
 
 	un = u->n;
@@ -392,11 +1336,10 @@ int fatunitwriteback(unit *u) {
 	return _fatunitwrite(u);
 }
 
-int _fatunitdeleteordetach(unit **cache, long n, int destroy) {
-	unit k, **s, *u;
+int _fatunitdeleteordetach(unitcache **cache, long n, int destroy) {
+	unit **s, *u;
 
-	k.n = n;
-	s = (unit **) tfind(&k, (void **) cache, _compareunit);
+	s = _fatunitfind(*cache, n);
 	if (s == NULL)
 		return -1;
 	u = *s;
@@ -404,9 +1347,7 @@ int _fatunitdeleteordetach(unit **cache, long n, int destroy) {
 	if (destroy && (u->refer > 0 || u->dirty))
 		return -1;
 
-	k.n = n;
-	if (NULL == tdelete(&k, (void **) cache, _compareunit))
-		return -1;
+	_fatunitcacheremove(*cache, s);
 
 	if (destroy)
 		fatunitdestroy(u);
@@ -414,27 +1355,165 @@ int _fatunitdeleteordetach(unit **cache, long n, int destroy) {
 	return 0;
 }
 
-int fatunitdetach(unit **cache, long n) {
+int fatunitdetach(unitcache **cache, long n) {
 	return _fatunitdeleteordetach(cache, n, 0);
 }
 
-int fatunitdelete(unit **cache, long n) {
+int fatunitdelete(unitcache **cache, long n) {
 	return _fatunitdeleteordetach(cache, n, 1);
 }
 
 /*
- * flush units in cache to filesystem
+ * flush units in cache to filesystem; the dirty units are sorted by position,
+ * and each sequence of adjacent ones is written by a single vectored write of
+ * at most fatunitflushsize bytes
  */
 
-void _fatunitflush(const void *nodep, const VISIT which, UNUSED_DEPTH) {
-	if (which != preorder && which != leaf)
+uint64_t fatunitflushsize = 1024 * 1024;
+
+int _compareposition(const void *a, const void *b) {
+	uint64_t pa, pb;
+	pa = _fatunitposition(* (unit **) a);
+	pb = _fatunitposition(* (unit **) b);
+	if (pa < pb)
+		return -1;
+	else if (pa == pb)
+		return 0;
+	else
+		return 1;
+}
+
+/*
+ * two units are written together if they are consecutive in the file and the
+ * modified part of the first extends to the modified part of the second
+ */
+int _fatunitadjacent(unit *u, unit *w) {
+	int ubegin, uend, wbegin, wend;
+
+	if (u->fd != w->fd || u->io != w->io ||
+	    u->origin == NO_ORIGIN || w->origin == NO_ORIGIN ||
+	    _fatunitposition(u) + u->size != _fatunitposition(w))
+		return 0;
+
+	_fatunitdirtyrange(u, &ubegin, &uend);
+	_fatunitdirtyrange(w, &wbegin, &wend);
+	return uend == u->size && wbegin == 0;
+}
+
+void _fatunitwriterun(unit **run, int len, struct iovec *iov) {
+	int i, begin, end, first;
+	uint64_t start;
+	ssize_t res, total;
+
+	if (len == 1 || fat_simulate_errors != NULL) {
+		for (i = 0; i < len; i++)
+			_fatunitwrite(run[i]);
+		return;
+	}
+
+	total = 0;
+	first = 0;
+	for (i = 0; i < len; i++) {
+		_fatunitdirtyrange(run[i], &begin, &end);
+		if (i == 0)
+			first = begin;
+		iov[i].iov_base = run[i]->data + begin;
+		iov[i].iov_len = end - begin;
+		total += end - begin;
+	}
+	dprintf("writing units %d-%d, %zd bytes\n",
+		run[0]->n, run[len - 1]->n, total);
+
+	start = _fatunitclock();
+	res = run[0]->io->writev(run[0]->io, run[0]->fd,
+		iov, len, _fatunitposition(run[0]) + first);
+	_fatunitcountwrite(run[0]->stats, 1, res, start);
+	if (res != total) {
+		dprintf("vectored write failed, writing units one by one\n");
+		for (i = 0; i < len; i++)
+			_fatunitwrite(run[i]);
+		return;
+	}
+
+	for (i = 0; i < len; i++)
+		run[i]->dirty = 0;
+}
+
+void fatunitflush(unitcache *cache) {
+	unit **dirty, *u;
+	struct iovec *iov;
+	int32_t i, n, start;
+	uint64_t size;
+
+	if (cache == NULL || cache->count == 0)
+		return;
+
+	dirty = malloc(cache->count * sizeof(unit *));
+	if (dirty == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	n = 0;
+	for (i = 0; i < 1 << cache->bits; i++) {
+		u = cache->table[i];
+		if (u != NULL && u->dirty && u->data != NULL)
+			dirty[n++] = u;
+	}
+	if (n == 0) {
+		free(dirty);
 		return;
-	
-	fatunitwriteback(* (unit **) nodep);
+	}
+	qsort(dirty, n, sizeof(unit *), _compareposition);
+	cache->stats.maxdirty = MAX(cache->stats.maxdirty, n);
+
+	iov = malloc(MIN(n, IOV_MAX) * sizeof(struct iovec));
+	if (iov == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+
+	for (start = 0; start < n; start = i) {
+		size = dirty[start]->size;
+		for (i = start + 1;
+		     i < n && i - start < IOV_MAX &&
+		     _fatunitadjacent(dirty[i - 1], dirty[i]) &&
+		     size + dirty[i]->size <= fatunitflushsize;
+		     i++)
+			size += dirty[i]->size;
+		_fatunitwriterun(dirty + start, i - start, iov);
+	}
+
+	free(iov);
+	free(dirty);
 }
 
-void fatunitflush(unit *cache) {
-	twalk(cache, _fatunitflush);
+/*
+ * call a function on all units in cache, in order; the units are collected
+ * first, so the function may insert or remove units
+ */
+
+void fatunitwalk(unitcache *cache,
+		void (*action)(unit *u, void *user), void *user) {
+	unit **all;
+	int32_t i, count;
+
+	if (cache == NULL || cache->count == 0)
+		return;
+
+	all = malloc(cache->count * sizeof(unit *));
+	if (all == NULL) {
+		printf("cannot allocate memory\n");
+		exit(1);
+	}
+	count = 0;
+	for (i = 0; i < 1 << cache->bits; i++)
+		if (cache->table[i] != NULL)
+			all[count++] = cache->table[i];
+	qsort(all, count, sizeof(unit *), _compareunit);
+
+	for (i = 0; i < count; i++)
+		action(all[i], user);
+	free(all);
 }
 
 /*
@@ -443,15 +1522,15 @@ void fatunitflush(unit *cache) {
 
 unsigned char *fatunitgetdata(unit *u) {
 	if (u->data == NULL) {
-		u->data = malloc(u->size);
-		if (u->data == NULL) {
-			printf("cannot allocate memory\n");
-			exit(1);
-		}
+		if (u->stats != NULL)
+			u->stats->misses++;
+		_fatunitdataalloc(u);
 		if (_fatunitread(u)) {
 			printf("unit %d no longer readable\n", u->n);
 			exit(1);
 		}
+		_fatunitpoollink(u);
+		_fatunitpoolshrink(u->pool);
 	}
 
 	return u->data;
@@ -460,31 +1539,48 @@ unsigned char *fatunitgetdata(unit *u) {
 void fatunitfree(unit *u) {
 	if (u->dirty || u->refer > 0)
 		return;
-	free(u->data);
-	u->data = NULL;
+	_fatunitpoolunlink(u);
+	_fatunitdatafree(u);
 }
 
-void _fatunitfreecache(const void *nodep, const VISIT which, UNUSED_DEPTH) {
-	if (which != preorder && which != leaf)
-		return;
-	
-	fatunitfree(* (unit **) nodep);
-}
+void fatunitfreecache(unitcache *cache) {
+	int32_t i;
 
-void fatunitfreecache(unit *cache) {
-	twalk(cache, _fatunitfreecache);
+	if (cache == NULL)
+		return;
+	for (i = 0; i < 1 << cache->bits; i++)
+		if (cache->table[i] != NULL)
+			fatunitfree(cache->table[i]);
 }
 
 /*
  * dellocate the entire cache
  */
 
-void _fatunitdeallocate(void *nodep) {
-	fatunitdestroy((unit *) nodep);
+void fatunitdeallocate(unitcache *cache) {
+	int32_t i;
+
+	if (cache == NULL)
+		return;
+	for (i = 0; i < 1 << cache->bits; i++)
+		if (cache->table[i] != NULL)
+			fatunitdestroy(cache->table[i]);
+	free(cache->table);
+	free(cache);
 }
 
-void fatunitdeallocate(unit *cache) {
-	tdestroy(cache, _fatunitdeallocate);
+/*
+ * statistics of a cache
+ */
+void fatunitstats(unitcache *cache, unitstats *stats, int reset) {
+	if (stats != NULL) {
+		if (cache == NULL)
+			memset(stats, 0, sizeof(unitstats));
+		else
+			*stats = cache->stats;
+	}
+	if (reset && cache != NULL)
+		memset(&cache->stats, 0, sizeof(unitstats));
 }
 
 /*
@@ -565,13 +1661,9 @@ void fatunitdiff(unit *src, unit *dst) {
  * dump all units for debugging
  */
 
-void _fatunitprint(const void *nodep, const VISIT which, UNUSED_DEPTH) {
-	unit *u;
+void _fatunitprint(unit *u, void *user) {
 	int i;
-
-	if (which != postorder && which != leaf)
-		return;
-	u = * (unit **) nodep;
+	(void) user;
 
 	printf("%7d:  ", u->n);
 	// printf("%6d %d:  ", u->n, u->refer);
@@ -589,8 +1681,7 @@ void _fatunitprint(const void *nodep, const VISIT which, UNUSED_DEPTH) {
 	printf("\n");
 }
 
-void fatunitdumpcache(char *which, unit *cache) {
+void fatunitdumpcache(char *which, unitcache *cache) {
 	printf("==== %s dump:\n", which);
-	twalk(cache, _fatunitprint);
+	fatunitwalk(cache, _fatunitprint, NULL);
 }
-
@@ -30,9 +30,21 @@
  *	size	the size of the data
  *	origin	position of unit 0 in fd, expressed in bytes
  *	data	the actual data
- *	dirty	the unit in cache differs from that in the filesystem
+ *	dirty	the unit in cache differs from that in the filesystem:
+ *		UNIT_DIRTY (1) in all its data, UNIT_PARTIAL (2) only in the
+ *		bytes from dirtybegin to dirtyend, as set by fatunitdirty();
+ *		only the sectors containing them are written back
  *	refer	usage counter; the unit cannot be removed if > 0
  *	user 	free for program use
+ *	pool	the memory pool of the cache the unit is in, if any
+ *	prefetched	read ahead by fatunitgetrun() and not used yet
+ *	io	the backend used to read and write the unit
+ *	slab	where the unit and its data are allocated, if not by malloc()
+ *	stats	the statistics of the cache the unit is in, if any
+ *
+ * a cache is a set of units indexed by their number n; it is a hash table with
+ * open addressing, so that finding a unit takes constant time; a NULL cache is
+ * an empty one, and is allocated when the first unit is inserted
  */
 
 #ifdef _UNIT_H
@@ -40,12 +52,20 @@
 #define _UNIT_H
 
 #include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define FAT_READ  1
 #define FAT_WRITE 2
 #define FAT_SEEK  4
 
-typedef struct {
+#define UNIT_DIRTY   1
+#define UNIT_PARTIAL 2
+
+/* granularity of partial writebacks */
+#define UNIT_DIRTYSECTOR 512
+
+typedef struct unit {
 	int fd;			/* filesystem this unit belongs to */
 	int32_t n;		/* index of sector/cluster */
 	int size;		/* size of this unit, in bytes */
@@ -53,10 +73,131 @@ typedef struct {
 	unsigned char *data;	/* the data */
 	int error;		/* error: read(1), write(2), seek(4) */
 	int dirty;		/* cached unit differs from file */
+	int dirtybegin;		/* modified bytes, if UNIT_PARTIAL */
+	int dirtyend;
 	int refer;		/* usage counter; no-remove if > 0 */
 	void *user;		/* free for program use */
+
+	struct unitpool *pool;	/* memory pool of its cache, if any */
+	struct unit *newer;	/* next more recently used unit in pool */
+	struct unit *older;	/* next less recently used unit in pool */
+	int hot;		/* in the protected list of the pool */
+	int prefetched;		/* read ahead, not yet used */
+
+	struct unitio *io;	/* how the unit is read and written */
+	struct unitslab *slab;	/* allocator of unit and data, if any */
+	struct unitstats *stats;	/* statistics of its cache, if any */
 } unit;
 
+/*
+ * statistics of a cache: lookups that found the unit with its data (hits) or
+ * not (misses), calls to the i/o backend by kind, bytes and nanoseconds spent
+ * in them, units evicted by the pool and the largest number of dirty units
+ * written by a single flush
+ */
+typedef struct unitstats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t reads;		/* calls to readat */
+	uint64_t readvs;	/* calls to readv */
+	uint64_t readbytes;
+	uint64_t readtime;
+	uint64_t writes;	/* calls to writeat */
+	uint64_t writevs;	/* calls to writev */
+	uint64_t writebytes;
+	uint64_t writetime;
+	uint64_t evictions;
+	int32_t maxdirty;
+} unitstats;
+
+typedef struct {
+	unit **table;		/* the units, NULL for empty slots */
+	int bits;		/* the table has 1 << bits slots */
+	int32_t count;		/* number of units in the table */
+	struct unitpool *pool;	/* memory pool, if any */
+	struct unitio *io;	/* backend of the units, NULL = unchanged */
+	struct unitslab *slab;	/* allocator of the units read, if any */
+	unitstats stats;	/* statistics */
+} unitcache;
+
+/*
+ * an i/o backend: how units are read from and written to fd; positions are in
+ * bytes from the start of fd; readat, writeat, readv and writev return the
+ * number of bytes transferred or -1 like pread() and pwrite(); flush makes
+ * the writes permanent, discard tells that a range of bytes is no longer used;
+ * both return 0 on success
+ *
+ * fatunitpio is the default, done with pread() and pwrite(); fatunitdirectio
+ * is for file descriptors opened with O_DIRECT: it falls back to buffered i/o
+ * for the transfers that are not aligned to sectors; other backends are
+ * installed in a cache by fatunitsetio() and are inherited by its units; user
+ * is free for use by the backend
+ */
+typedef struct unitio {
+	ssize_t (*readat)(struct unitio *io, int fd,
+		void *buf, size_t len, uint64_t pos);
+	ssize_t (*writeat)(struct unitio *io, int fd,
+		const void *buf, size_t len, uint64_t pos);
+	ssize_t (*readv)(struct unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos);
+	ssize_t (*writev)(struct unitio *io, int fd,
+		const struct iovec *iov, int iovcnt, uint64_t pos);
+	int (*flush)(struct unitio *io, int fd);
+	int (*discard)(struct unitio *io, int fd, uint64_t pos, uint64_t len);
+	void *user;
+} unitio;
+
+extern unitio fatunitpio;
+extern unitio fatunitdirectio;
+
+/*
+ * a pool bounds the memory taken by the data of the units in one or more
+ * caches; when the data exceeds max bytes, the least recently used units that
+ * are not referred have their data freed, after being written back if dirty;
+ * units can still be accessed after that, since fatunitgetdata() reloads them
+ *
+ * UNIT_LRU evicts the least recently used units; UNIT_SLRU is scan-resistant:
+ * a unit enters a probation list, and moves to a protected one only if it is
+ * used again; probation units are evicted first, so that a single pass over
+ * many units (like a visit of all files) does not evict the ones that are
+ * used over and over (like the sectors of the fat)
+ */
+#define UNIT_LRU  0
+#define UNIT_SLRU 1
+
+typedef struct unitpool {
+	uint64_t max;		/* max bytes of data, 0 = no limit */
+	uint64_t size;		/* bytes of data of units in the pool */
+	int policy;		/* UNIT_LRU or UNIT_SLRU */
+	unit *newest[2];	/* lists: probation (0) and protected (1) */
+	unit *oldest[2];
+	int32_t count[2];	/* number of units in each list */
+	uint64_t hotsize;	/* bytes of data in the protected list */
+} unitpool;
+
+/*
+ * a slab allocates the units read in a cache and their data from large chunks
+ * of memory, one list of chunks for each size; freed units and data are
+ * reused, and all chunks are released at once by fatunitslabdestroy(); this
+ * is faster than malloc() and wastes less memory on small units; if units
+ * detached from their cache are still alive, the chunks are released only by
+ * the fatunitdestroy() of the last of them; data of 512 bytes or more is
+ * aligned to 512 bytes, as required by direct i/o
+ */
+typedef struct unitslabclass {
+	int size;		/* size of blocks */
+	void *free;		/* list of free blocks */
+	void *chunks;		/* list of chunks */
+} unitslabclass;
+
+typedef struct unitslab {
+	unitslabclass *classes;	/* one for each size */
+	int nclasses;
+	uint64_t size;		/* bytes allocated in chunks */
+	int32_t units;		/* units allocated and not destroyed */
+	int destroyed;		/* release when no unit is left */
+} unitslab;
+
 /* a 8/16/32 bit integer at some byte offset in a unit */
 #define _unitoffset(unit, offset) &fatunitgetdata(unit)[offset]
 
@@ -73,25 +214,64 @@ unit *fatunitcreate(int size);
 unit *fatunitcopy(unit *u);
 void fatunitdestroy(unit *u);
 
+/* mark len bytes of a unit at offset as modified */
+void fatunitdirty(unit *u, int offset, int len);
+
 /* get, insert, detach, move, swap, writeback and delete a unit from a cache */
-unit *fatunitget(unit **cache, uint64_t origin, int size, long n, int fd);
-int fatunitinsert(unit **cache, unit *u, int replace);
-int fatunitdetach(unit **cache, long n);
-void fatunitmove(unit **cache, unit *u, int dest);
-void fatunitswap(unit **cache, unit *u, unit *w);
+unit *fatunitget(unitcache **cache,
+		uint64_t origin, int size, long n, int fd);
+int fatunitinsert(unitcache **cache, unit *u, int replace);
+int fatunitdetach(unitcache **cache, long n);
+void fatunitmove(unitcache **cache, unit *u, int dest);
+void fatunitswap(unitcache **cache, unit *u, unit *w);
 int fatunitwriteback(unit *u);
-int fatunitdelete(unit **cache, long n);
+int fatunitdelete(unitcache **cache, long n);
 
-/* flush all dirty units to filesystem */
-void fatunitflush(unit *cache);
+/* get a unit to be overwritten without reading it; write past the cache */
+unit *fatunitgetblank(unitcache **cache,
+		uint64_t origin, int size, long n, int fd);
+int fatunitwritedirect(unitcache *cache, uint64_t origin, int size, long n,
+		int fd, unsigned char *data, int len);
+
+/* read consecutive units at once; check whether a unit is cached */
+int fatunitgetrun(unitcache **cache,
+		uint64_t origin, int size, long n, int count, int fd);
+int fatunitcached(unitcache *cache, long n);
+
+/* create and destroy a memory pool, use it for a cache */
+unitpool *fatunitpoolcreate(uint64_t max, int policy);
+void fatunitpooldestroy(unitpool *pool);
+void fatunitsetpool(unitcache **cache, unitpool *pool);
+
+/* use an i/o backend for the units of a cache */
+void fatunitsetio(unitcache **cache, unitio *io);
+
+/* create and destroy a slab, use it for a cache */
+unitslab *fatunitslabcreate();
+void fatunitslabdestroy(unitslab *slab);
+void fatunitsetslab(unitcache **cache, unitslab *slab);
+
+/* flush all dirty units to filesystem, writing adjacent ones together */
+void fatunitflush(unitcache *cache);
+
+/* max bytes written by a single call when flushing */
+extern uint64_t fatunitflushsize;
+
+/* call a function on all units in cache, in increasing order of number */
+void fatunitwalk(unitcache *cache,
+		void (*action)(unit *u, void *user), void *user);
 
 /* deal with deallocated units (data only); README: Note 1 **/
 unsigned char *fatunitgetdata(unit *u);
 void fatunitfree(unit *u);
-void fatunitfreecache(unit *cache);
+void fatunitfreecache(unitcache *cache);
 
 /* deallocate cache */
-void fatunitdeallocate(unit *cache);
+void fatunitdeallocate(unitcache *cache);
+
+/* copy the statistics of a cache to stats if not NULL, then reset them if
+ * reset is not zero */
+void fatunitstats(unitcache *cache, unitstats *stats, int reset);
 
 /* dump a unit to stdout */
 void fatunitdump(unit *u, int hex);
@@ -100,7 +280,7 @@ void fatunitdump(unit *u, int hex);
 void fatunitdiff(unit *src, unit *dst);
 
 /* dump all cached units, for debugging */
-void fatunitdumpcache(char *which, unit *cache);
+void fatunitdumpcache(char *which, unitcache *cache);
 
 /* simulated errors */
 struct fat_simulate_errors_s {
@@ -38,7 +38,6 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
-#include <search.h>
 #include <inttypes.h>
 #include <llfat.h>
 
@@ -142,19 +141,11 @@ int copydirectoryclusters(fat *f,
 /*
  * copy a sector in cache to the new filesystem
  */
-void copysector(const void *nodep, const VISIT which, const int depth) {
-	static fat *dst;
-	unit *o, *d, *c;
-
-	if (depth == -1) {
-		dst = (fat *) nodep;
-		return;
-	}
-
-	if (which != postorder && which != leaf)
-		return;
+void copysector(unit *o, void *user) {
+	fat *dst;
+	unit *d, *c;
 
-	o = * (unit **) nodep;
+	dst = (fat *) user;
 
 	if (diffonly) {
 		d = fatunitget(&dst->sectors, 0, o->size, o->n, dst->fd);
@@ -194,7 +185,7 @@ void copysector(const void *nodep, const VISIT which, const int depth) {
 int main(int argn, char *argv[]) {
 	char *srcname, *dstname;
 	fat *src, *dst;
-	int overwrite, usedonly, whole, remove;
+	int overwrite, usedonly, whole, direct, remove;
 	int sectors, size, s;
 	int nfat;
 	int res;
@@ -204,6 +195,7 @@ int main(int argn, char *argv[]) {
 	overwrite = 0;
 	usedonly = 0;
 	whole = 0;
+	direct = 0;
 	while (argn - 1 >= 1 && argv[1][0] == '-') {
 		switch(argv[1][1]) {
 		case 'i':
@@ -224,13 +216,16 @@ int main(int argn, char *argv[]) {
 		case 'w':
 			whole = 1;
 			break;
+		case 'D':
+			direct = 1;
+			break;
 		}
 		argn--;
 		argv++;
 	}
 
 	if (argn - 1 < 2) {
-		printf("usage:\n\tfatbackup [-i] [-u] [-a] [-t] [-p] [-w] ");
+		printf("usage:\n\tfatbackup [-i] [-u] [-a] [-t] [-p] [-w] [-D] ");
 		printf("source destination\n");
 		printf("\t\t-i\toverwrite without asking\n");
 		printf("\t\t-u\tcopy only sectors of FAT that are used\n");
@@ -242,6 +237,7 @@ int main(int argn, char *argv[]) {
 		printf("of the differing sectors\n");
 		printf("\t\t-w\tmake destination as large as ");
 		printf("the whole filesystem\n");
+		printf("\t\t-D\tread the source with direct i/o\n");
 		exit(1);
 	}
 
@@ -255,6 +251,8 @@ int main(int argn, char *argv[]) {
 		printf("cannot open %s as a FAT filesystem\n", srcname);
 		exit(1);
 	}
+	if (direct && fatsetdirect(src))
+		exit(1);
 
 	if (fatcheck(src)) {
 		printf("%s does not appear a FAT filesystem\n", srcname);
@@ -324,8 +322,7 @@ int main(int argn, char *argv[]) {
 
 			/* copy sectors */
 
-	copysector(dst, 0, -1);
-	twalk(src->sectors, copysector);
+	fatunitwalk(src->sectors, copysector, dst);
 	printf("\n");
 
 			/* close */
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <inttypes.h>
 #define __USE_UNIX98
 #include <wchar.h>
 #include <llfat.h>
@@ -80,6 +81,53 @@ void fatprintentrylong(fat __attribute__((unused)) *f, char *path,
 	printf("\n");
 }
 
+/*
+ * look up (op=0), create (1) or delete (2) a file in the root directory, and
+ * describe the result; for comparing a filesystem with indexes and one without
+ */
+void fatcacheop(fat *f, int op, char *name, char *result) {
+	int32_t dir;
+	unit *directory, *longdirectory;
+	int index, longindex;
+	char path[100], shortname[13];
+
+	dir = fatgetrootbegin(f);
+	snprintf(path, 100, "/%s", name);
+	if (fatlookuppathlongbothdir(f, &dir, path,
+			&directory, &index, &longdirectory, &longindex)) {
+		if (op != 1) {
+			sprintf(result, "%-15s not found", name);
+			return;
+		}
+		dir = fatgetrootbegin(f);
+		if (fatcreatefilelong(f, dir, name, &directory, &index)) {
+			sprintf(result, "%-15s cannot create", name);
+			return;
+		}
+		fatentrygetshortname(directory, index, shortname);
+		sprintf(result, "%-15s created %d,%d %s",
+			name, directory->n, index, shortname);
+		return;
+	}
+
+	fatentrygetshortname(directory, index, shortname);
+	sprintf(result, "%-15s found %d,%d %d,%d %s", name,
+		longdirectory->n, longindex, directory->n, index, shortname);
+	if (op == 2) {
+		fatdeletelong(f, longdirectory, longindex);
+		fatentrydelete(directory, index);
+		strcat(result, " deleted");
+	}
+}
+
+/*
+ * count the units in the protected list of their pool
+ */
+void fatcounthot(unit *u, void *user) {
+	if (u->hot)
+		(* (int *) user)++;
+}
+
 /*
  * main
  */
@@ -100,6 +148,12 @@ int main(int argn, char *argv[]) {
 	int res;
 	struct fatlongscan scan;
 	char longname[1000], *in, *out;
+	fat *g;
+	char name[100], result[200], other[200];
+	int op, errors, steps[5] = {1, 2, 0, 1, 0};
+	unit *cmp;
+	uint64_t hotsize, misses;
+	int hot;
 
 	if (argn - 1 < 1) {
 		printf("usage:\n\tfattest filename [test]\n");
@@ -1152,6 +1206,104 @@ int main(int argn, char *argv[]) {
 		printf("original:  %s\nlegalized: %s\n", in, out);
 
 		break;
+
+	case 42:
+		printf("\n********* name index and path cache test\n");
+
+		/* same operations with and without indexes, compare results;
+		 * only the indexed filesystem is written back */
+		g = fatopen(filename, 0);
+		if (g == NULL)
+			break;
+		fatsetnameindex(f, 1);
+		fatsetpathcache(f, 1);
+
+		/* create, delete one in three and look them up, create
+		 * them again, look up all; the common stem makes the short
+		 * names go past ~4 */
+		errors = 0;
+		for (op = 0; op < 5; op++)
+			for (i = 0; i < 60; i++) {
+				if ((op == 1 || op == 2) && i % 3 != 0)
+					continue;
+				sprintf(name, "vacation%d.c", i);
+				fatcacheop(f, steps[op], name, result);
+				fatcacheop(g, steps[op], name, other);
+				printf("%s\n", result);
+				if (strcmp(result, other)) {
+					printf("MISMATCH: %s\n", other);
+					errors++;
+				}
+			}
+
+		/* the file allocation table and the clusters in use */
+		if (r < FAT_FIRST) {
+			cmp = fatclusterread(g, r);
+			cluster = fatclusterread(f, r);
+			if (memcmp(fatunitgetdata(cluster), fatunitgetdata(cmp),
+					cluster->size)) {
+				printf("root directory differs\n");
+				errors++;
+			}
+		}
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
+			n = fatgetnextcluster(f, cl);
+			if (n != fatgetnextcluster(g, cl)) {
+				printf("next of cluster %d differs\n", cl);
+				errors++;
+				continue;
+			}
+			if (n == FAT_UNUSED)
+				continue;
+			cmp = fatclusterread(g, cl);
+			cluster = fatclusterread(f, cl);
+			if (cluster == NULL || cmp == NULL ||
+			    memcmp(fatunitgetdata(cluster),
+			    		fatunitgetdata(cmp), cluster->size)) {
+				printf("cluster %d differs\n", cl);
+				errors++;
+			}
+		}
+
+		printf("%d differences\n", errors);
+		fatquit(g);
+
+		break;
+
+	case 43:
+		printf("\n********* read-ahead and protected cache test\n");
+
+		/* the sectors of the fat are used repeatedly, the clusters
+		 * once each; read ahead, the clusters must not be protected,
+		 * while the sectors of the fat are */
+		fatsetcachelimit(f, 1024 * 1024, UNIT_SLRU);
+		for (i = 0; i < 2; i++)
+			for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+				fatgetnextcluster(f, cl);
+		hotsize = f->pool->hotsize;
+		printf("protected bytes after reading the fat: %" PRIu64 "\n",
+			hotsize);
+
+		n = 0;
+		misses = f->clusters == NULL ? 0 : f->clusters->stats.misses;
+		for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++)
+			if (fatgetnextcluster(f, cl) != FAT_UNUSED &&
+			    fatclusterread(f, cl) != NULL)
+				n++;
+		printf("clusters read: %d, ", n);
+		printf("of which read ahead: %" PRIu64 "\n",
+			n - (f->clusters->stats.misses - misses));
+
+		hot = 0;
+		fatunitwalk(f->clusters, fatcounthot, &hot);
+		printf("protected bytes: %" PRIu64 ", protected clusters: %d\n",
+			f->pool->hotsize, hot);
+		if (hot != 0)
+			printf("ERROR: clusters read once are protected\n");
+		else
+			printf("ok\n");
+
+		break;
 	}
 
 	printf("===========================================\n");
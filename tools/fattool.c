@@ -41,6 +41,7 @@
 #include <portable_endian.h>
 
 #define MAX(a,b) (((a) > (b)) ? (a) : (b))
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
 
 /*
  * use longname or not
@@ -312,14 +313,17 @@ uint32_t bootposition(char *filename, int sectorsize, unsigned bound) {
  * map of the free clusters
  */
 void fatmap(fat *f, char *used, char *unused, char *bad) {
-	int32_t cl, next;
+	int32_t cl, next, entries[1024];
 	char buf[50], other[50], another[50];
 	int len, pos;
 
 	pos = 0;
 
 	for (cl = FAT_FIRST; cl <= fatlastcluster(f); cl++) {
-		next = fatgetnextcluster(f, cl);
+		if ((cl - FAT_FIRST) % 1024 == 0)
+			fatgetnextclusterrange(f, cl,
+				MIN(1024, fatlastcluster(f) - cl + 1), entries);
+		next = entries[(cl - FAT_FIRST) % 1024];
 		if (next == FAT_UNUSED) {
 			sprintf(buf, used, cl);
 			sprintf(other, unused, cl);
@@ -348,6 +352,30 @@ void fatmap(fat *f, char *used, char *unused, char *bad) {
 	printf("\n");
 }
 
+/*
+ * print a difference between the fats and how it is fixed
+ */
+void printfatsdiff(fat *f, int32_t cl, int32_t *values, int32_t merged,
+		void *user) {
+	int nfat;
+
+	printf("%d -> ", cl);
+	for (nfat = 0; nfat < fatgetnumfats(f); nfat++) {
+		if (nfat > 0)
+			printf("/");
+		fatprintfat(f, values[nfat]);
+	}
+
+	if (merged == FAT_ERR) {
+		printf(" NOFIX\n");
+		*((int *) user) = 0;
+		return;
+	}
+	printf(" -> ");
+	fatprintfat(f, merged);
+	printf("\n");
+}
+
 /*
  * restore the filesystem to its pristine state
  */
@@ -378,7 +406,6 @@ int fatlink(fat *f, char *target, char *new, int ncluster, uint32_t size) {
 	int32_t targetprev, targetcluster;
 	int32_t dir;
 	uint8_t attributes;
-	int i;
 
 	// fatdirectorydebug = 1;
 
@@ -389,14 +416,10 @@ int fatlink(fat *f, char *target, char *new, int ncluster, uint32_t size) {
 	}
 	printf("source: ");
 	fatreferenceprint(targetdir, targetind, targetprev);
-	for (i = 0; i < ncluster; i++) {
-		targetcluster = fatgetnextcluster(f, targetcluster);
-		if (targetcluster == FAT_EOF || targetcluster == FAT_UNUSED)
-			break;
-	}
+	if (ncluster != 0)
+		targetcluster = fatchaincluster(f, targetcluster, ncluster);
 	printf(" cluster %d\n", targetcluster);
-	if (ncluster != 0 &&
-	    (targetcluster == FAT_EOF || targetcluster == FAT_UNUSED)) {
+	if (ncluster != 0 && targetcluster < FAT_FIRST) {
 		printf("cluster number too large\n");
 		return -1;
 	}
@@ -432,13 +455,41 @@ int fatlink(fat *f, char *target, char *new, int ncluster, uint32_t size) {
 	return 0;
 }
 
+/*
+ * print the statistics of the caches
+ */
+void printunitstats(char *which, unitstats *s) {
+	printf("%s: %" PRIu64 " hits, %" PRIu64 " misses, ",
+		which, s->hits, s->misses);
+	printf("%" PRIu64 " evictions, max %d dirty\n",
+		s->evictions, s->maxdirty);
+	printf("\tread:  %" PRIu64 " calls, %" PRIu64 " vectored, ",
+		s->reads, s->readvs);
+	printf("%" PRIu64 " bytes, %.6f seconds\n",
+		s->readbytes, s->readtime / 1e9);
+	printf("\twrite: %" PRIu64 " calls, %" PRIu64 " vectored, ",
+		s->writes, s->writevs);
+	printf("%" PRIu64 " bytes, %.6f seconds\n",
+		s->writebytes, s->writetime / 1e9);
+}
+
+void printstats(fat *f) {
+	unitstats sectors, clusters;
+
+	fatstats(f, &sectors, &clusters, 0);
+	printf("==== cache statistics:\n");
+	printunitstats("sectors", &sectors);
+	printunitstats("clusters", &clusters);
+}
+
 /*
  * write a cluster with content coming from stdin
  */
 void fatclusterwrite(fat *f, int32_t cl, int part, int readbefore) {
 	uint64_t origin;
-	int size;
+	int size, res;
 	unit *cluster;
+	unsigned char *buf;
 
 	if (cl < FAT_ROOT || cl > fatlastcluster(f)) {
 		printf("invalid cluster: %d\n", cl);
@@ -447,24 +498,33 @@ void fatclusterwrite(fat *f, int32_t cl, int part, int readbefore) {
 
 	fatclusterposition(f, cl, &origin, &size);
 
-	if (readbefore)
-		cluster = fatclusterread(f, cl);
-	else {
-		cluster = fatclustercreate(f, cl);
-		if (cluster == NULL)
-			cluster = fatclusterread(f, cl);
+	if (! readbefore) {
+		buf = malloc(size);
+		if (buf == NULL) {
+			printf("cannot allocate memory\n");
+			exit(1);
+		}
+		res = read(0, buf, size);
+		if (res != size && ! part) {
+			printf("writing less than a whole cluster ");
+			printf("is disallowed\n");
+			printf("enable with option \"part\"\n");
+			exit(1);
+		}
+		if (res > 0 && fatclusterwritedirect(f, cl, buf, res))
+			printf("cannot write cluster %d\n", cl);
+		free(buf);
+		return;
 	}
+
+	cluster = fatclusterread(f, cl);
 	if (cluster == NULL) {
 		printf("cannot read/create cluster %d\n", cl);
 		return;
 	}
 
-	if (read(0, fatunitgetdata(cluster), size) != size &&
-			! part && ! readbefore) {
-		printf("writing less than a whole cluster is disallowed\n");
-		printf("enable with option \"part\"\n");
-		exit(1);
-	}
+	if (read(0, fatunitgetdata(cluster), size) < 0)
+		perror("stdin");
 
 	cluster->dirty = 1;
 	if (fatunitwriteback(cluster))
@@ -1262,14 +1322,72 @@ int parserange(char *option, int32_t *first, int32_t *last) {
 	return 0;
 }
 
+/*
+ * parse a cache limit in kilobytes and its optional policy
+ */
+int parsecachelimit(char *option, uint64_t *limit) {
+	char *end;
+
+	errno = 0;
+	*limit = strtoull(option, &end, 10) * 1024;
+	if (end == option || ! isdigit((unsigned char) *option)) {
+		printf("invalid cache limit: %s\n", option);
+		return -1;
+	}
+	if (errno == ERANGE) {
+		printf("overflow: %s\n", option);
+		return -1;
+	}
+	if (*end == '\0' || ! strcmp(end, ",slru"))
+		return UNIT_SLRU;
+	if (! strcmp(end, ",lru"))
+		return UNIT_LRU;
+	printf("unknown cache policy: %s\n", end);
+	return -1;
+}
+
+/*
+ * parse an allocation policy and its optional size
+ */
+int parsepolicy(char *option, int32_t *size) {
+	char *comma;
+	int len, policy;
+
+	comma = strchr(option, ',');
+	len = comma == NULL ? (int) strlen(option) : comma - option;
+	if (len == 4 && ! strncmp(option, "next", 4))
+		policy = FAT_ALLOC_NEXT;
+	else if (len == 4 && ! strncmp(option, "best", 4))
+		policy = FAT_ALLOC_BEST;
+	else if (len == 4 && ! strncmp(option, "near", 4))
+		policy = FAT_ALLOC_NEAR;
+	else if (len == 7 && ! strncmp(option, "reserve", 7))
+		policy = FAT_ALLOC_RESERVE;
+	else {
+		printf("unknown allocation policy: %s\n", option);
+		return -1;
+	}
+
+	*size = policy == FAT_ALLOC_NEXT || policy == FAT_ALLOC_NEAR ? 1 : 16;
+	if (comma != NULL) {
+		*size = atoi(comma + 1);
+		if (*size <= 0) {
+			printf("invalid allocation size: %s\n", comma + 1);
+			return -1;
+		}
+	}
+	return policy;
+}
+
 /*
  * usage
  */
 void usage() {
 	printf("usage:\n\tfattool [-f num] [-l] [-s] [-t] [-n] ");
-	printf("[-m] [-c] [-o offset] [-p num]\n");
-	printf("\t\t[-a first-last] [-v level] [-e simerr.txt] ");
-	printf("device operation [arg...]\n");
+	printf("[-m] [-c] [-S] [-D] [-T] [-z] [-R] [-I] [-o offset] [-p num]\n");
+	printf("\t\t[-a first-last] [-A policy[,size]] ");
+	printf("[-M kbytes[,lru|,slru]] [-v level]\n\t\t");
+	printf("[-e simerr.txt]\n\t\tdevice operation [arg...]\n");
 	printf("\t\t-f num\t\tuse the specified file allocation table\n");
 	printf("\t\t-l\t\tload the first FAT in cache immediately\n");
 	printf("\t\t-s\t\tuse shortnames\n");
@@ -1277,10 +1395,21 @@ void usage() {
 	printf("\t\t-n\t\tdo not check or convert names\n");
 	printf("\t\t-m\t\tmemory check at the end\n");
 	printf("\t\t-c\t\tcheck: show cluster cache at the end\n");
+	printf("\t\t-S\t\tshow cache and i/o statistics at the end\n");
+	printf("\t\t-D\t\tdirect i/o, bypassing the system buffers\n");
+	printf("\t\t-T\t\tdecode the file allocation table in memory\n");
+	printf("\t\t-z\t\tsame, as runs of consecutive clusters\n");
+	printf("\t\t-R\t\tcopy the first FAT to the others only at the end\n");
+	printf("\t\t-I\t\tindex the names and cache the paths\n");
 	printf("\t\t-o offset\tfilesystem starts at this offset in device\n");
 	printf("\t\t-d\t\tdetermine number of bits from signature\n");
 	printf("\t\t-b num\t\tuse n-th sector as the boot sector\n");
 	printf("\t\t-a first-last\trange of allocable clusters\n");
+	printf("\t\t-A policy[,size]\n");
+	printf("\t\t\t\tnext, best, near or reserve: how to choose ");
+	printf("the\n\t\t\t\tclusters of files, see man\n");
+	printf("\t\t-M kbytes[,lru|,slru]\n");
+	printf("\t\t\t\tlimit the memory used by the cache\n");
 	printf("\t\t-v level\tverbose output\n");
 	printf("\t\t-e simerr.txt\tread simulated errors from file\n");
 	printf("\n\toperations:\n");
@@ -1363,7 +1492,7 @@ void usage() {
 	printf("\t\t\t\tdelete a file\n");
 	printf("\t\toverwrite name [test]\n\t\t\t\toverwrite the ");
 	printf("differing clusters of a file\n");
-	printf("\t\tconsecutive name size\n\t\t\t\tcreate a ");
+	printf("\t\tconsecutive name size [best]\n\t\t\t\tcreate a ");
 	printf("file of consecutive clusters\n");
 	printf("\t\tgetattrib file\tget attributes of file\n");
 	printf("\t\tsetattrib file attrib\n\t\t\t\tset attributes of file\n");
@@ -1409,13 +1538,14 @@ int main(int argn, char *argv[]) {
 	char *name, *operation, *option1, *option2, *option3, *option4;
 	int partition;
 	uint32_t begin, length, fsize;
-	int32_t afirst, alast;
+	int32_t afirst, alast, asize;
+	int policy;
 	off_t offset;
 	int signature, debug;
 	char *longname, *longpath, *legalized;
 	fat *f, *cross;
 	int fatnum, bootindex;
-	int32_t previous, target, r, dir, cl, next, other, start;
+	int32_t previous, target, r, dir, cl, next, start;
 	int32_t secondprevious, secondtarget, end, last, len;
 	unit *directory, *startdirectory, *longdirectory, *seconddirectory;
 	int index, startindex, longindex, secondindex;
@@ -1429,8 +1559,11 @@ int main(int argn, char *argv[]) {
 	int nfat;
 	char *timeformat;
 	struct tm tm;
-	int first, clusterdump, insensitive, memcheck;
+	int first, clusterdump, insensitive, memcheck, stats, direct, decode;
+	int compress, mirror, nameindex;
 	int immediate, testonly, try;
+	uint64_t cachelimit;
+	int cachepolicy;
 	fatinverse *rev;
 	char *simerrfile;
 	int dirty;
@@ -1452,8 +1585,18 @@ int main(int argn, char *argv[]) {
 	nostoragepaths = 0;
 	afirst = -1;
 	alast = -1;
+	policy = FAT_ALLOC_NEXT;
+	asize = 1;
 	memcheck = 0;
+	stats = 0;
+	direct = 0;
+	decode = 0;
+	compress = 0;
+	mirror = 0;
+	nameindex = 0;
 	clusterdump = 0;
+	cachelimit = 0;
+	cachepolicy = UNIT_SLRU;
 	debug = 0;
 	simerrfile = NULL;
 	while (argn - 1 >= 1 && argv[1][0] == '-') {
@@ -1532,12 +1675,50 @@ int main(int argn, char *argv[]) {
 			if (res < 0)
 				exit(EXIT_FAILURE);
 			break;
+		case 'A':
+			buf = argv[1][2] != '\0' ? argv[1] + 2 : argv[2];
+			if (argv[1][2] == '\0') {
+				argn--;
+				argv++;
+			}
+			policy = parsepolicy(buf, &asize);
+			if (policy < 0)
+				exit(EXIT_FAILURE);
+			break;
 		case 'm':
 			memcheck = 1;
 			break;
+		case 'M':
+			buf = argv[1][2] != '\0' ? argv[1] + 2 : argv[2];
+			if (argv[1][2] == '\0') {
+				argn--;
+				argv++;
+			}
+			cachepolicy = parsecachelimit(buf, &cachelimit);
+			if (cachepolicy < 0)
+				exit(EXIT_FAILURE);
+			break;
 		case 'c':
 			clusterdump = 1;
 			break;
+		case 'S':
+			stats = 1;
+			break;
+		case 'D':
+			direct = 1;
+			break;
+		case 'T':
+			decode = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'R':
+			mirror = 1;
+			break;
+		case 'I':
+			nameindex = 1;
+			break;
 		case 'v':
 			if (argv[1][2] != '\0')
 				debug = atoi(argv[1] + 1);
@@ -1682,6 +1863,14 @@ int main(int argn, char *argv[]) {
 	last = fatlastcluster(f);
 
 	f->insensitive = insensitive;
+	if (nameindex) {
+		fatsetnameindex(f, 1);
+		fatsetpathcache(f, 1);
+	}
+	if (cachelimit != 0)
+		fatsetcachelimit(f, cachelimit, cachepolicy);
+	if (direct && fatsetdirect(f))
+		exit(1);
 	if (fatnum != -1) {
 		if (fatnum < 0 || fatnum >= fatgetnumfats(f)) {
 			printf("invalid FAT number: %d, ", fatnum);
@@ -1691,9 +1880,20 @@ int main(int argn, char *argv[]) {
 		}
 		f->nfat = fatnum;
 	}
+	if (decode && fatdecodefat(f, f->nfat == FAT_ALL ? 0 : f->nfat)) {
+		printf("error decoding FAT\n");
+		exit(1);
+	}
+	if (compress && fatcompressfat(f, f->nfat == FAT_ALL ? 0 : f->nfat)) {
+		printf("error compressing FAT\n");
+		exit(1);
+	}
+	if (mirror)
+		fatsetmirror(f, 1);
 
 	afirst = afirst != -1 ? afirst : FAT_FIRST;
 	alast = alast != -1 ? alast : fatlastcluster(f);
+	fatsetallocation(f, policy, asize, afirst, alast);
 
 				/* read first FAT if -f passed */
 
@@ -1979,11 +2179,19 @@ int main(int argn, char *argv[]) {
 			fatentrygetsize(directory, index) :
 			(unsigned) atoi(option3);
 
-		for (cl = target;
-		     cl >= FAT_FIRST && size > 0;
-		     cl = fatreferencenext(f, &directory, &index, &previous))
-			size -= fatbytespercluster(f);
-		fatreferencesettarget(f, directory, index, previous, FAT_EOF);
+		if (size <= 0)
+			cl = target;
+		else {
+			previous = fatchaincluster(f, target,
+				(size - 1) / fatbytespercluster(f));
+			directory = NULL;
+			index = 0;
+			cl = previous < FAT_FIRST ?
+				previous : fatgetnextcluster(f, previous);
+		}
+		if (size <= 0 || previous >= FAT_FIRST)
+			fatreferencesettarget(f,
+				directory, index, previous, FAT_EOF);
 		if (chain)
 			fatclusterfreechain(f, cl);
 	}
@@ -2007,8 +2215,7 @@ int main(int argn, char *argv[]) {
 			else if (size <= 0)
 				fatsetnextcluster(f, cl, FAT_EOF);
 			else if (next == FAT_EOF || next == FAT_UNUSED) {
-				next = fatclusterfindfreebetween(f,
-					afirst, alast, -1);
+				next = fatclusterallocate(f, cl);
 				fatsetnextcluster(f, cl, next);
 				fatsetnextcluster(f, next, FAT_EOF);
 			}
@@ -2073,9 +2280,7 @@ int main(int argn, char *argv[]) {
 			}
 			fatsetnextcluster(f, cl, next);
 			fatsetnextcluster(f, next, FAT_EOF);
-			cluster = fatclustercreate(f, next);
-			size -= cluster->size;
-			fatunitdelete(&f->clusters, next);
+			size -= fatbytespercluster(f);
 		}
 	}
 	else if (! strcmp(operation, "position")) {
@@ -2224,7 +2429,7 @@ int main(int argn, char *argv[]) {
 	else if (! strcmp(operation, "checkfats") ||
 		 ! strcmp(operation, "mergefats")) {
 		testonly = ! strcmp(operation, "checkfats");
-		if (fatgetnumfats(f) != 2) {
+		if (fatgetnumfats(f) < 2) {
 			printf("this filesystem does not have two fats\n");
 			exit(EXIT_FAILURE);
 		}
@@ -2242,42 +2447,14 @@ int main(int argn, char *argv[]) {
 			check();
 			printf("\n");
 		}
-		diff = 0;
 		res = 1;
-		for (cl = start; cl <= end; cl++) {
-			next = fatgetfat(f, 0, cl);
-			other = fatgetfat(f, 1, cl);
-			if (next == other)
-				continue;
-			diff = 1;
-			printf("%d -> ", cl);
-			fatprintfat(f, next);
-			printf("/");
-			fatprintfat(f, other);
-
-			if (next > fatlastcluster(f) &&
-			         other <= fatlastcluster(f))
-				next = other;
-			else if (next <= fatlastcluster(f) &&
-			         other > fatlastcluster(f))
-				other = next;
-			else if (nfat == 0)
-				other = next;
-			else if (nfat == 1)
-				next = other;
-			else {
-				printf(" NOFIX\n");
-				res = 0;
-				continue;
-			}
-			printf(" -> ");
-			fatprintfat(f, next);
-			printf("\n");
-
-			if (! testonly) {
-				fatsetfat(f, 0, cl, next);
-				fatsetfat(f, 1, cl, next);
-			}
+		diff = testonly ?
+			fatcomparefats(f, start, end, nfat, printfatsdiff, &res) :
+			fatmergefats(f, start, end, nfat, printfatsdiff, &res);
+		if (diff == -1) {
+			printf("cannot compare fats on clusters %d - %d\n",
+				start, end);
+			exit(EXIT_FAILURE);
 		}
 		if (diff == 0)
 			printf("no difference in FATs\n");
@@ -2537,10 +2714,11 @@ int main(int argn, char *argv[]) {
 		printf("max: %d\n", max);
 
 		fatreferencesettarget(f, directory, index, cl, FAT_UNUSED);
+		f->allocnear = directory->n;
 
+		buf = malloc(fatbytespercluster(f));
 		do {
-			next = fatclusterfindfreebetween(f,
-				afirst, alast, -1);
+			next = fatclusterallocate(f, cl);
 			printf("next: %d max: %d       \r", next, max);
 			if (next == FAT_ERR) {
 				printf("filesystem full\n");
@@ -2548,23 +2726,16 @@ int main(int argn, char *argv[]) {
 			}
 
 			if (max == -1) {
-				cluster = fatclustercreate(f, next);
-				if (cluster == NULL)
-					cluster = fatclusterread(f, next);
-				if (cluster == NULL) {
-					printf("error creating cluster %d\n",
+				csize = fatbytespercluster(f);
+				res = read(0, buf, csize);
+
+				if (res > 0 &&
+				    fatclusterwritedirect(f, next,
+						(unsigned char *) buf, res)) {
+					printf("error writing cluster %d\n",
 						next);
 					exit(1);
 				}
-
-				csize = cluster->size;
-				res = read(0, fatunitgetdata(cluster), csize);
-
-				if (res > 0) {
-					cluster->dirty = 1;
-					fatunitwriteback(cluster);
-				}
-				fatunitdelete(&f->clusters, cluster->n);
 			}
 			else {
 				csize = fatbytespercluster(f);
@@ -2582,6 +2753,7 @@ int main(int argn, char *argv[]) {
 
 			size += res;
 		} while (res == csize);
+		free(buf);
 
 		fatentrysetsize(startdirectory, startindex, size);
 		fatentrysetattributes(startdirectory, startindex, 0x20);
@@ -2750,8 +2922,11 @@ int main(int argn, char *argv[]) {
 		ncluster = (size + fatbytespercluster(f) - 1) /
 			fatbytespercluster(f);
 
-		start = fatclusterfindfreesequencebetween(f,
-			afirst, alast, -1, ncluster);
+		start = ! strcmp(option3, "best") ?
+			fatclusterfindbestfreesequencebetween(f,
+				afirst, alast, ncluster) :
+			fatclusterfindfreesequencebetween(f,
+				afirst, alast, -1, ncluster);
 		if (start == FAT_ERR) {
 			printf("not enough consecutive free clusters\n");
 			exit(1);
@@ -2925,7 +3100,8 @@ int main(int argn, char *argv[]) {
 			exit(1);
 		}
 		fatentrysetattributes(directory, index, 0x10);
-		next = fatclusterfindfreebetween(f, afirst, alast, -1);
+		f->allocnear = directory->n;
+		next = fatclusterallocate(f, -1);
 		if (next == FAT_ERR) {
 			printf("filesystem full\n");
 			exit(1);
@@ -3346,6 +3522,10 @@ int main(int argn, char *argv[]) {
 
 	if (clusterdump)
 		fatunitdumpcache("clusters", f->clusters);
+	if (stats) {
+		fatflush(f);
+		printstats(f);
+	}
 	fatclose(f);
 	if (memcheck) {
 		printf("==== memory check:\n");